@@ -0,0 +1,323 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HANDSHAKE_FUZZER_H__
+#define __HANDSHAKE_FUZZER_H__
+
+/*
+ * Drives Handshake and CertificateService through the stub stack from a
+ * byte string decoded into GATT/GAP events. Shared by the fuzz target and
+ * the host benchmark, which replays the corpus handshake with it.
+ */
+
+#include <new>
+#include "Handshake.h"
+
+#if defined(FUZZ_REPLAY)
+static bool fuzzTrace = false;
+#define FUZZ_TRACE(...)         do { if (fuzzTrace) { fprintf(stderr, __VA_ARGS__); } } while (0)
+#else
+#define FUZZ_TRACE(...)         ((void)0)
+#endif
+
+// Broken invariants abort, so both libFuzzer and the replay keep the input
+#define FUZZ_ASSERT(expr)       do { if (!(expr)) { FUZZ_TRACE("invariant: %s\n", #expr); abort(); } } while (0)
+
+
+enum FuzzOp
+{
+    FUZZ_CONNECT,
+    FUZZ_DISCONNECT,
+    FUZZ_SECURITY,
+    FUZZ_SUBSCRIBE,
+    FUZZ_WRITE,
+    FUZZ_READ,
+    FUZZ_DISPATCH,
+    FUZZ_ADVANCE,
+    FUZZ_FAIL_WRITES,
+    FUZZ_QUEUED_WRITE,
+    _FUZZ_OPS
+};
+
+
+/** Reads the input front to back, yielding zeros once it runs out */
+class FuzzInput
+{
+public:
+    FuzzInput(const uint8_t* data, size_t size) :
+        _data(data),
+        _size(size),
+        _pos(0)
+    {
+    }
+
+    bool done() const
+    {
+        return _pos >= _size;
+    }
+
+    uint8_t u8()
+    {
+        return _pos < _size ? _data[_pos++] : 0;
+    }
+
+    uint16_t u16()
+    {
+        uint16_t lo = u8();
+        return lo | (uint16_t)(u8() << 8);
+    }
+
+    /** Up to len bytes straight out of the input, so overreads hit its end */
+    const uint8_t* bytes(uint16_t& len)
+    {
+        if (len > _size - _pos)
+        {
+            len = (uint16_t)(_size - _pos);
+        }
+
+        const uint8_t* p = &_data[_pos];
+        _pos += len;
+        return p;
+    }
+
+private:
+    const uint8_t* _data;
+    size_t _size;
+    size_t _pos;
+};
+
+
+class HandshakeFuzzer
+{
+public:
+    HandshakeFuzzer() :
+        _ble(BLE::Instance()),
+        _noncePool(NULL),
+        _lastStep(Handshake::NONE)
+    {
+        // Everything long lived is built once, per input state is reset in place
+        _certificateService = new CertificateService(_ble);
+        _noncePool = new (_noncePoolStorage) NoncePool(_eventQueue);
+        Handshake::Init(_ble, _eventQueue, _certificateService, _noncePool);
+        _ble.gattServer().onUpdatesEnabled(&Handshake::onSubscribed);
+        _handshake = Handshake::Instance();
+    }
+
+    void run(const uint8_t* data, size_t size)
+    {
+        reset();
+
+        FuzzInput input(data, size);
+        while (!input.done())
+        {
+            step(input);
+            check();
+        }
+
+        // Let whatever is still pending play out
+        for (int i = 0; i < 64 && _eventQueue.dispatchNext(); i++)
+        {
+            check();
+        }
+    }
+
+    Handshake* handshake() const
+    {
+        return _handshake;
+    }
+
+    CertificateService* certificateService() const
+    {
+        return _certificateService;
+    }
+
+private:
+    void reset()
+    {
+        _handshake->reset();
+        _eventQueue.clear();
+        _ble.gattServer().reset();
+        rtos::Kernel::clock() = 0;
+        _lastStep = Handshake::NONE;
+
+        // The pool's refill bookkeeping points into the queue just cleared
+        _noncePool->~NoncePool();
+        _noncePool = new (_noncePoolStorage) NoncePool(_eventQueue);
+    }
+
+    void step(FuzzInput& input)
+    {
+        switch (input.u8() % _FUZZ_OPS)
+        {
+            case FUZZ_CONNECT:
+                FUZZ_TRACE("connect\n");
+                _ble.gap().connected(0);
+                break;
+
+            case FUZZ_DISCONNECT:
+                FUZZ_TRACE("disconnect\n");
+                _ble.gap().disconnected(0, 0x13);
+                break;
+
+            case FUZZ_SECURITY:
+            {
+                SecurityManager::SecurityCompletionStatus_t status = input.u8() & 1 ?
+                    SecurityManager::SEC_STATUS_SUCCESS : SecurityManager::SEC_STATUS_TIMEOUT;
+                FUZZ_TRACE("security status=%d\n", status);
+                _ble.securityManager().securitySetupCompleted(0, status);
+                break;
+            }
+
+            case FUZZ_SUBSCRIBE:
+            {
+                GattAttribute::Handle_t handle = pickHandle(input.u8());
+                FUZZ_TRACE("subscribe handle=%u\n", handle);
+                _ble.gattServer().updatesEnabled(handle);
+                break;
+            }
+
+            case FUZZ_WRITE:
+                write(input);
+                break;
+
+            case FUZZ_READ:
+                read(input.u16());
+                break;
+
+            case FUZZ_DISPATCH:
+                FUZZ_TRACE("dispatch (%d pending)\n", _eventQueue.pending());
+                _eventQueue.dispatchNext();
+                break;
+
+            case FUZZ_ADVANCE:
+            {
+                uint16_t ms = input.u16();
+                FUZZ_TRACE("advance %u ms\n", ms);
+                _eventQueue.advance(ms);
+                break;
+            }
+
+            case FUZZ_FAIL_WRITES:
+            {
+                uint8_t count = input.u8() % 4;
+                FUZZ_TRACE("fail next %u writes\n", count);
+                _ble.gattServer().failWrites(count);
+                break;
+            }
+
+            case FUZZ_QUEUED_WRITE:
+                queuedWrite(input);
+                break;
+        }
+    }
+
+    void write(FuzzInput& input)
+    {
+        GattWriteCallbackParams params;
+        params.connHandle = 0;
+        params.writeOp = (GattWriteCallbackParams::WriteOp_t)(input.u8() % 7);
+        params.handle = pickHandle(input.u8());
+        params.offset = input.u16();
+        params.len = input.u8();
+        params.data = input.bytes(params.len);
+
+        FUZZ_TRACE("write op=%d handle=%u offset=%u len=%u data=", params.writeOp, params.handle, params.offset, params.len);
+        for (uint16_t i = 0; i < params.len; i++)
+        {
+            FUZZ_TRACE("%02x", params.data[i]);
+        }
+        FUZZ_TRACE("\n");
+
+        _ble.gattServer().dataWritten(&params);
+    }
+
+    /** A long write whose fragments the stack kept, longer than one write can be */
+    void queuedWrite(FuzzInput& input)
+    {
+        GattAttribute::Handle_t handle = pickHandle(input.u8());
+        uint16_t len = input.u16() % (STUB_MAX_VALUE_LEN + 1);
+        const uint8_t* data = input.bytes(len);
+
+        FUZZ_TRACE("queued write handle=%u len=%u\n", handle, len);
+        _ble.gattServer().queuedWrite(handle, data, len);
+    }
+
+    void read(uint16_t offset)
+    {
+        GattCharacteristic* characteristic = _ble.gattServer().find(_certificateService->sfidaToCentralHandle());
+
+        GattReadAuthCallbackParams params;
+        params.connHandle = 0;
+        params.handle = _certificateService->sfidaToCentralHandle();
+        params.offset = offset;
+        params.len = 0;
+        params.data = NULL;
+
+        GattAuthCallbackReply_t reply = characteristic->authorizeRead(&params);
+        FUZZ_TRACE("read offset=%u -> reply=0x%x len=%u\n", offset, reply, params.len);
+
+        if (reply == AUTH_CALLBACK_REPLY_SUCCESS && params.data != NULL)
+        {
+            FUZZ_ASSERT(params.len <= READ_REPLY_MAX_LEN);
+            FUZZ_ASSERT(params.offset + params.len <= SFIDA_TO_CENTRAL_MAX_LEN);
+
+            volatile uint8_t sink = 0;
+            for (uint16_t i = 0; i < params.len; i++)
+            {
+                sink ^= params.data[i];
+            }
+        }
+    }
+
+    /** Mostly centralToSfida, sometimes any of the other handles */
+    GattAttribute::Handle_t pickHandle(uint8_t selector)
+    {
+        switch (selector % 4)
+        {
+            case 0:
+                return _certificateService->sfidaCommandsHandle();
+            case 1:
+                return _certificateService->sfidaToCentralHandle();
+            default:
+                return _certificateService->centralToSfidaHandle();
+        }
+    }
+
+    void check()
+    {
+        if (_handshake->step() != _lastStep)
+        {
+            _lastStep = _handshake->step();
+            FUZZ_TRACE("  step %d\n", _lastStep);
+        }
+
+        FrameView frame = _certificateService->frame();
+        FUZZ_ASSERT(frame.len <= CENTRAL_TO_SFIDA_MAX_LEN);
+        FUZZ_ASSERT(frame.len == 0 || frame.data != NULL);
+        FUZZ_ASSERT(_handshake->step() >= Handshake::NONE && _handshake->step() < Handshake::_HANDSHAKE_PAIRING_END);
+    }
+
+    BLE& _ble;
+    EventQueue _eventQueue;
+    CertificateService* _certificateService;
+    NoncePool* _noncePool;
+    Handshake* _handshake;
+    Handshake::HandshakeStep _lastStep;
+
+    alignas(NoncePool) unsigned char _noncePoolStorage[sizeof(NoncePool)];
+};
+
+#endif /* #ifndef __HANDSHAKE_FUZZER_H__ */
@@ -0,0 +1,113 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The Benchmark suite on the host stubs, with the host baselines.
+ *
+ * connect_to_resp replays a corpus handshake (connection to
+ * RESP_00_00_00_00) through the same driver as the fuzz target, a fixed
+ * number of times. Allocations are counted through operator new. Exits
+ * non-zero on any regression:
+ *   g++ -std=c++11 -O2 -Ifuzz/stubs -Isource fuzz/benchmark_host.cpp -o benchmark_host
+ *   ./benchmark_host fuzz/corpus/pairing
+ */
+
+#define MBED_CONF_APP_LOG               0
+#define MBED_CONF_APP_NONCE_POOL_SEED   0x5EED
+#define MBED_CONF_APP_BENCHMARK         1
+#define MBED_HEAP_STATS_ENABLED         1
+#define BENCHMARK_HOST                  1
+#define BENCHMARK_ITERATIONS            65536   // sub-microsecond ops against a microsecond clock
+
+#include "HandshakeFuzzer.h"
+#include "Benchmark.h"
+
+Handshake* Handshake::_instance = NULL;
+Handshake* Benchmark::_handshake = NULL;
+CertificateService* Benchmark::_certificateService = NULL;
+uint8_t Benchmark::_payload[SFIDA_TO_CENTRAL_MAX_LEN - SFIDA_COMMAND_LEN];
+
+
+static uint32_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL)
+    {
+        abort();
+    }
+
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void mbed_stats_heap_get(mbed_stats_heap_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->alloc_cnt = allocations;
+}
+
+
+static HandshakeFuzzer* fuzzer = NULL;
+static uint8_t corpus[1 << 12];
+static size_t corpusSize = 0;
+
+static void connectToResp()
+{
+    fuzzer->run(corpus, corpusSize);
+
+    // A replay that stops short would time the wrong thing
+    if (fuzzer->handshake()->step() != Handshake::RESP_00_00_00_00)
+    {
+        fprintf(stderr, "replay did not reach RESP_00_00_00_00 (step %d)\n", fuzzer->handshake()->step());
+        abort();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "fuzz/corpus/pairing";
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return 2;
+    }
+
+    corpusSize = fread(corpus, 1, sizeof(corpus), file);
+    fclose(file);
+
+    static HandshakeFuzzer driver;
+    fuzzer = &driver;
+
+    return Benchmark::Run(driver.handshake(), driver.certificateService(), &connectToResp) ? 1 : 0;
+}
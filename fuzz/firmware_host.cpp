@@ -0,0 +1,305 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * FirmwareService on the host stubs, over the simulated flash.
+ *
+ * The writer thread is not scheduled: its queue is dispatched one job at
+ * a time between packets, so each scenario fixes exactly how far the
+ * flash lags the radio. Exits non-zero on any failure:
+ *   g++ -std=c++11 -Ifuzz/stubs -Isource fuzz/firmware_host.cpp -o firmware_host
+ *   ./firmware_host
+ */
+
+#define MBED_CONF_APP_LOG                       0
+#define MBED_CONF_APP_FIRMWARE_UPDATE           1
+#define MBED_CONF_APP_FIRMWARE_BANK_ADDRESS     0x40000
+#define MBED_CONF_APP_FIRMWARE_BANK_SIZE        0x10000     // 16 simulated sectors, the last one for the record
+#define FIRMWARE_FLASH_SIMULATED                1
+
+#include "FirmwareService.h"
+
+#define IMAGE_SIZE      10001   // not a whole number of words, nor of staging buffers
+
+
+static int failures = 0;
+
+#define CHECK(scenario, cond)                                               \
+    do {                                                                    \
+        if (!(cond))                                                        \
+        {                                                                   \
+            printf("%s: %s failed (line %d)\n", scenario, #cond, __LINE__); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+
+class FirmwareHostTest
+{
+public:
+    FirmwareHostTest() :
+        _service(_ble, _eventQueue)
+    {
+        for (uint32_t i = 0; i < sizeof(_image); i++)
+        {
+            _image[i] = (uint8_t)(i * 7 + (i >> 8));
+        }
+
+        MbedCRC<POLY_32BIT_ANSI, 32> crc;
+        crc.compute(_image, sizeof(_image), &_crc);
+    }
+
+    void request(uint8_t op, uint32_t size = 0, uint32_t crc = 0)
+    {
+        FirmwareRequest request = { op, size, crc };
+        write(_service.updateRequestHandle(), (const uint8_t*)&request, sizeof(request));
+    }
+
+    void packet(const uint8_t* data, uint16_t len)
+    {
+        write(_service.dataHandle(), data, len);
+    }
+
+    /** One writer job, then whatever it posted back */
+    bool step()
+    {
+        if (!_service._writerQueue.dispatchNext())
+        {
+            return false;
+        }
+
+        while (_eventQueue.dispatchNext())
+        {
+        }
+
+        return true;
+    }
+
+    void settle()
+    {
+        while (step())
+        {
+        }
+    }
+
+    /** Sends the image, never beyond the credit of the last status */
+    uint32_t stream()
+    {
+        uint32_t sent = 0;
+        while (sent < sizeof(_image) && _service._state == FirmwareService::STATE_RECEIVING)
+        {
+            uint16_t len = sizeof(_image) - sent < FIRMWARE_PACKET_MAX_LEN ? sizeof(_image) - sent : FIRMWARE_PACKET_MAX_LEN;
+            if (sent + len > _service._status.received + _service._status.credit)
+            {
+                if (!step())
+                {
+                    break;
+                }
+
+                continue;
+            }
+
+            packet(&_image[sent], len);
+            sent += len;
+        }
+
+        return sent;
+    }
+
+    /** Up to COMMITTING, with the commit itself still queued */
+    void receiveAll()
+    {
+        request(FirmwareService::REQUEST_START, sizeof(_image), _crc);
+        stream();
+        while (_service._state == FirmwareService::STATE_RECEIVING && step())
+        {
+        }
+    }
+
+    bool bankHoldsImage()
+    {
+        static uint8_t bank[IMAGE_SIZE];
+        return _service._flash.read(bank, MBED_CONF_APP_FIRMWARE_BANK_ADDRESS, sizeof(bank)) == 0 &&
+            memcmp(bank, _image, sizeof(bank)) == 0;
+    }
+
+    FirmwareBootRecord bootRecord()
+    {
+        FirmwareBootRecord record;
+        _service._flash.read(&record, _service.bootRecordAddress(), sizeof(record));
+        return record;
+    }
+
+    bool recordErased()
+    {
+        FirmwareBootRecord record = bootRecord();
+        return record.magic == 0xFFFFFFFF && record.size == 0xFFFFFFFF && record.crc == 0xFFFFFFFF;
+    }
+
+    FirmwareService::State state() const
+    {
+        return (FirmwareService::State)_service._state;
+    }
+
+    uint8_t outstanding() const
+    {
+        return _service._outstanding;
+    }
+
+    uint32_t received() const
+    {
+        return _service._received;
+    }
+
+    uint32_t crc() const
+    {
+        return _crc;
+    }
+
+    const uint8_t* image() const
+    {
+        return _image;
+    }
+
+private:
+    void write(GattAttribute::Handle_t handle, const uint8_t* data, uint16_t len)
+    {
+        GattWriteCallbackParams params = { 0, handle, GattWriteCallbackParams::OP_WRITE_CMD, 0, len, data };
+        _ble.gattServer().dataWritten(&params);
+    }
+
+    BLE _ble;
+    EventQueue _eventQueue;
+    FirmwareService _service;
+
+    uint8_t _image[IMAGE_SIZE];
+    uint32_t _crc;
+};
+
+
+static void staged()
+{
+    FirmwareHostTest test;
+    test.receiveAll();
+    CHECK("staged", test.state() == FirmwareService::STATE_COMMITTING);
+    test.settle();
+
+    FirmwareBootRecord record = test.bootRecord();
+    CHECK("staged", test.state() == FirmwareService::STATE_STAGED);
+    CHECK("staged", test.bankHoldsImage());
+    CHECK("staged", record.magic == FIRMWARE_BOOT_MAGIC);
+    CHECK("staged", record.size == IMAGE_SIZE);
+    CHECK("staged", record.crc == test.crc());
+    CHECK("staged", record.reserved == 0xFFFFFFFF);
+    CHECK("staged", test.outstanding() == 0);
+}
+
+static void abortStaged()
+{
+    FirmwareHostTest test;
+    test.receiveAll();
+    test.settle();
+    test.request(FirmwareService::REQUEST_ABORT);
+    test.settle();
+
+    CHECK("abort staged", test.state() == FirmwareService::STATE_IDLE);
+    CHECK("abort staged", test.recordErased());
+    CHECK("abort staged", test.outstanding() == 0);
+}
+
+static void abortCommitting()
+{
+    FirmwareHostTest test;
+    test.receiveAll();
+    CHECK("abort committing", test.state() == FirmwareService::STATE_COMMITTING);
+    test.request(FirmwareService::REQUEST_ABORT);
+    test.settle();
+
+    // The record was written behind the abort, then taken back
+    CHECK("abort committing", test.state() == FirmwareService::STATE_IDLE);
+    CHECK("abort committing", test.recordErased());
+    CHECK("abort committing", test.outstanding() == 0);
+}
+
+static void overrun()
+{
+    FirmwareHostTest test;
+    test.request(FirmwareService::REQUEST_START, IMAGE_SIZE, test.crc());
+
+    // The writer never gets to run, so the credit is ignored
+    for (uint32_t sent = 0; sent < IMAGE_SIZE && test.state() == FirmwareService::STATE_RECEIVING; sent += FIRMWARE_PACKET_MAX_LEN)
+    {
+        test.packet(&test.image()[sent], FIRMWARE_PACKET_MAX_LEN);
+    }
+
+    CHECK("overrun", test.state() == FirmwareService::STATE_ERROR_OVERRUN);
+    CHECK("overrun", test.received() > 2 * FIRMWARE_STAGING_SIZE);
+    CHECK("overrun", test.received() <= 2 * FIRMWARE_STAGING_SIZE + FIRMWARE_PACKET_MAX_LEN);
+    test.settle();
+    CHECK("overrun", test.outstanding() == 0);
+}
+
+static void badCrc()
+{
+    FirmwareHostTest test;
+    test.request(FirmwareService::REQUEST_START, IMAGE_SIZE, test.crc() ^ 1);
+    test.stream();
+    test.settle();
+
+    CHECK("bad crc", test.state() == FirmwareService::STATE_ERROR_CRC);
+    CHECK("bad crc", test.recordErased());
+}
+
+static void busy()
+{
+    FirmwareHostTest test;
+    test.request(FirmwareService::REQUEST_START, IMAGE_SIZE, test.crc());
+    for (uint32_t sent = 0; sent < FIRMWARE_STAGING_SIZE; sent += FIRMWARE_PACKET_MAX_LEN)
+    {
+        test.packet(&test.image()[sent], FIRMWARE_PACKET_MAX_LEN);
+    }
+
+    // The first buffer is still queued for the writer
+    test.request(FirmwareService::REQUEST_ABORT);
+    test.request(FirmwareService::REQUEST_START, IMAGE_SIZE, test.crc());
+    CHECK("busy", test.state() == FirmwareService::STATE_ERROR_BUSY);
+
+    test.settle();
+    test.request(FirmwareService::REQUEST_START, IMAGE_SIZE, test.crc());
+    CHECK("busy", test.state() == FirmwareService::STATE_RECEIVING);
+}
+
+static void tooLarge()
+{
+    FirmwareHostTest test;
+    test.request(FirmwareService::REQUEST_START, MBED_CONF_APP_FIRMWARE_BANK_SIZE, test.crc());
+    CHECK("too large", test.state() == FirmwareService::STATE_ERROR_SIZE);
+}
+
+int main()
+{
+    staged();
+    abortStaged();
+    abortCommitting();
+    overrun();
+    badCrc();
+    busy();
+    tooLarge();
+
+    printf("%s: %d failures, %lu ms of simulated flash time\n", failures ? "FAIL" : "PASS", failures,
+        (unsigned long)(stubWaitedUs() / 1000));
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-process fuzz target for Handshake and CertificateService.
+ *
+ * The input is decoded into a sequence of GATT/GAP events (connection,
+ * security, subscription, centralToSfida writes of every kind, blob reads
+ * of sfidaToCentral, event queue dispatch, clock advance, TX buffer
+ * exhaustion) that is raised through the stub stack into the real
+ * handlers. Nothing is printed and nothing is allocated per input.
+ *
+ * libFuzzer with sanitizers:
+ *   clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined \
+ *       -Ifuzz/stubs -Isource fuzz/fuzz_handshake.cpp -o fuzz_handshake
+ *   ./fuzz_handshake -max_len=1024 corpus/
+ *
+ * Any compiler, replaying inputs (e.g. a libFuzzer crash-<sha1>) and
+ * printing the decoded event trace, or running random inputs:
+ *   g++ -std=c++11 -g -DFUZZ_REPLAY -Ifuzz/stubs -Isource \
+ *       fuzz/fuzz_handshake.cpp -o fuzz_replay
+ *   ./fuzz_replay crash-<sha1>
+ *   ./fuzz_replay -runs=100000
+ */
+
+#define MBED_CONF_APP_LOG               0
+#define MBED_CONF_APP_NONCE_POOL_SEED   0x5EED
+
+#include "HandshakeFuzzer.h"
+
+Handshake* Handshake::_instance = NULL;
+
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static HandshakeFuzzer fuzzer;
+    fuzzer.run(data, size);
+    return 0;
+}
+
+
+#if defined(FUZZ_REPLAY)
+#include <time.h>
+
+static int replay(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return 1;
+    }
+
+    static uint8_t data[1 << 16];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+
+    fprintf(stderr, "== %s (%zu bytes)\n", path, size);
+    fuzzTrace = true;
+    LLVMFuzzerTestOneInput(data, size);
+    fuzzTrace = false;
+    return 0;
+}
+
+/** Random inputs without libFuzzer, as a smoke test and a speed check */
+static int runRandom(unsigned long runs)
+{
+    static uint8_t data[512];
+    uint32_t state = 0x2545F491;
+
+    clock_t start = clock();
+    for (unsigned long run = 0; run < runs; run++)
+    {
+        size_t size = 1 + state % sizeof(data);
+        for (size_t i = 0; i < size; i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            data[i] = (uint8_t)state;
+        }
+
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%lu runs in %.2f s (%.0f exec/s)\n", runs, seconds, seconds > 0 ? runs / seconds : 0.0);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int res = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-runs=", 6) == 0)
+        {
+            res |= runRandom(strtoul(argv[i] + 6, NULL, 10));
+        }
+        else
+        {
+            res |= replay(argv[i]);
+        }
+    }
+
+    return res;
+}
+#endif
@@ -0,0 +1,88 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_CALLBACK_H__
+#define __STUB_CALLBACK_H__
+
+#include <stddef.h>
+#include <string.h>
+
+
+/**
+ * Heap free holder for a free function or an object + member function,
+ * the only two shapes the sources register with the stack.
+ */
+template <typename A>
+class StubCallback
+{
+public:
+    StubCallback() :
+        _object(NULL),
+        _thunk(NULL),
+        _function(NULL)
+    {
+    }
+
+    void attach(void (*function)(A))
+    {
+        _object = NULL;
+        _thunk = NULL;
+        _function = function;
+    }
+
+    template <typename T, typename M>
+    void attach(T* object, M method)
+    {
+        static_assert(sizeof(M) <= sizeof(_method), "member function pointer too large");
+        memcpy(_method, &method, sizeof(M));
+        _object = object;
+        _thunk = &invoke<T, M>;
+        _function = NULL;
+    }
+
+    operator bool() const
+    {
+        return _thunk != NULL || _function != NULL;
+    }
+
+    void call(A arg) const
+    {
+        if (_thunk != NULL)
+        {
+            _thunk(_object, _method, arg);
+        }
+        else if (_function != NULL)
+        {
+            _function(arg);
+        }
+    }
+
+private:
+    template <typename T, typename M>
+    static void invoke(void* object, const char* method, A arg)
+    {
+        M m;
+        memcpy(&m, method, sizeof(M));
+        (((T*)object)->*m)(arg);
+    }
+
+    void* _object;
+    void (*_thunk)(void*, const char*, A);
+    void (*_function)(A);
+    char _method[2 * sizeof(void*)];
+};
+
+#endif /* #ifndef __STUB_CALLBACK_H__ */
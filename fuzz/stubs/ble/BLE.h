@@ -0,0 +1,519 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_BLE_H__
+#define __STUB_BLE_H__
+
+/*
+ * Host stand-in for the mbed BLE API subset the handshake path uses.
+ * Callbacks are stored, not run: the fuzz driver raises the events.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "StubCallback.h"
+
+
+#define STUB_MAX_CHARACTERISTICS    8
+#define STUB_MAX_VALUE_LEN          512
+
+
+enum ble_error_t
+{
+    BLE_ERROR_NONE = 0,
+    BLE_ERROR_BUFFER_OVERFLOW = 1,
+    BLE_ERROR_NOT_IMPLEMENTED = 2,
+    BLE_ERROR_PARAM_OUT_OF_RANGE = 3,
+    BLE_ERROR_INVALID_PARAM = 4,
+    BLE_STACK_BUSY = 5,
+    BLE_ERROR_INVALID_STATE = 6,
+    BLE_ERROR_NO_MEM = 7
+};
+
+enum GattAuthCallbackReply_t
+{
+    AUTH_CALLBACK_REPLY_SUCCESS = 0x00,
+    AUTH_CALLBACK_REPLY_ATTERR_INVALID_HANDLE = 0x0101,
+    AUTH_CALLBACK_REPLY_ATTERR_READ_NOT_PERMITTED = 0x0102,
+    AUTH_CALLBACK_REPLY_ATTERR_INVALID_OFFSET = 0x0107,
+    AUTH_CALLBACK_REPLY_ATTERR_INVALID_ATTRIBUTE_VALUE_LENGTH = 0x010D
+};
+
+
+class GattAttribute
+{
+public:
+    typedef uint16_t Handle_t;
+};
+
+struct GattWriteCallbackParams
+{
+    enum WriteOp_t
+    {
+        OP_INVALID = 0x00,
+        OP_WRITE_REQ = 0x01,
+        OP_WRITE_CMD = 0x02,
+        OP_SIGN_WRITE_CMD = 0x03,
+        OP_PREP_WRITE_REQ = 0x04,
+        OP_EXEC_WRITE_REQ_CANCEL = 0x05,
+        OP_EXEC_WRITE_REQ_NOW = 0x06
+    };
+
+    uint16_t connHandle;
+    GattAttribute::Handle_t handle;
+    WriteOp_t writeOp;
+    uint16_t offset;
+    uint16_t len;
+    const uint8_t* data;
+};
+
+struct GattReadAuthCallbackParams
+{
+    uint16_t connHandle;
+    GattAttribute::Handle_t handle;
+    uint16_t offset;
+    uint16_t len;
+    uint8_t* data;
+    GattAuthCallbackReply_t authorizationReply;
+};
+
+
+class GattCharacteristic
+{
+public:
+    enum
+    {
+        BLE_GATT_CHAR_PROPERTIES_NONE = 0x00,
+        BLE_GATT_CHAR_PROPERTIES_BROADCAST = 0x01,
+        BLE_GATT_CHAR_PROPERTIES_READ = 0x02,
+        BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE = 0x04,
+        BLE_GATT_CHAR_PROPERTIES_WRITE = 0x08,
+        BLE_GATT_CHAR_PROPERTIES_NOTIFY = 0x10,
+        BLE_GATT_CHAR_PROPERTIES_INDICATE = 0x20
+    };
+
+    struct SecurityRequirement_t
+    {
+        enum type
+        {
+            NONE,
+            UNAUTHENTICATED,
+            AUTHENTICATED,
+            SC_AUTHENTICATED
+        };
+    };
+
+    GattCharacteristic(const char* uuid, uint8_t* value, uint16_t len, uint16_t maxLen, uint8_t properties) :
+        _handle(0),
+        _maxLen(maxLen),
+        _properties(properties),
+        _valueLen(0)
+    {
+    }
+
+    void setSecurityRequirements(SecurityRequirement_t::type read, SecurityRequirement_t::type write, SecurityRequirement_t::type update)
+    {
+    }
+
+    template <typename T>
+    void setReadAuthorizationCallback(T* object, void (T::*method)(GattReadAuthCallbackParams*))
+    {
+        _readAuthorization.attach(object, method);
+    }
+
+    /** What the stack does on a read of an authorized characteristic */
+    GattAuthCallbackReply_t authorizeRead(GattReadAuthCallbackParams* params)
+    {
+        if (!_readAuthorization)
+        {
+            return AUTH_CALLBACK_REPLY_SUCCESS;
+        }
+
+        params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+        _readAuthorization.call(params);
+        return params->authorizationReply;
+    }
+
+    GattAttribute::Handle_t getValueHandle() const
+    {
+        return _handle;
+    }
+
+    uint16_t getMaxLength() const
+    {
+        return _maxLen;
+    }
+
+    uint8_t getProperties() const
+    {
+        return _properties;
+    }
+
+    void setValueHandle(GattAttribute::Handle_t handle)
+    {
+        _handle = handle;
+    }
+
+    /** The attribute table copy of the value, as the stack keeps it */
+    bool setValue(uint16_t offset, const uint8_t* value, uint16_t len)
+    {
+        if (offset + len > _maxLen || offset + len > STUB_MAX_VALUE_LEN)
+        {
+            return false;
+        }
+
+        memcpy(&_value[offset], value, len);
+        _valueLen = offset + len;
+        return true;
+    }
+
+    const uint8_t* getValue() const
+    {
+        return _value;
+    }
+
+    uint16_t getValueLength() const
+    {
+        return _valueLen;
+    }
+
+private:
+    GattAttribute::Handle_t _handle;
+    uint16_t _maxLen;
+    uint8_t _properties;
+    uint8_t _value[STUB_MAX_VALUE_LEN];
+    uint16_t _valueLen;
+    StubCallback<GattReadAuthCallbackParams*> _readAuthorization;
+};
+
+
+class GattService
+{
+public:
+    GattService(const char* uuid, GattCharacteristic* characteristics[], unsigned count) :
+        _characteristics(characteristics),
+        _count(count)
+    {
+    }
+
+    GattCharacteristic* getCharacteristic(unsigned index)
+    {
+        return index < _count ? _characteristics[index] : NULL;
+    }
+
+    unsigned getCharacteristicCount() const
+    {
+        return _count;
+    }
+
+private:
+    GattCharacteristic** _characteristics;
+    unsigned _count;
+};
+
+
+class GattServer
+{
+public:
+    GattServer() :
+        _count(0),
+        _nextHandle(0),
+        _failWrites(0)
+    {
+    }
+
+    /** Hands out value handles like the SoftDevice (declaration, value, CCCD) */
+    ble_error_t addService(GattService& service)
+    {
+        _nextHandle++;
+        for (unsigned i = 0; i < service.getCharacteristicCount(); i++)
+        {
+            GattCharacteristic* characteristic = service.getCharacteristic(i);
+            if (_count >= STUB_MAX_CHARACTERISTICS)
+            {
+                return BLE_ERROR_NO_MEM;
+            }
+
+            characteristic->setValueHandle(_nextHandle + 1);
+            _nextHandle += characteristic->getProperties() & GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY ? 3 : 2;
+            _characteristics[_count++] = characteristic;
+        }
+
+        return BLE_ERROR_NONE;
+    }
+
+    /** Fails the next count writes, as when the notification TX buffers are full */
+    void failWrites(uint8_t count)
+    {
+        _failWrites = count;
+    }
+
+    ble_error_t write(GattAttribute::Handle_t handle, const uint8_t* value, uint16_t size, bool localOnly = false)
+    {
+        GattCharacteristic* characteristic = find(handle);
+        if (characteristic == NULL)
+        {
+            return BLE_ERROR_INVALID_PARAM;
+        }
+
+        // The stack would silently truncate: treat it as a bug
+        if (size > characteristic->getMaxLength())
+        {
+            abort();
+        }
+
+        // Touch every byte so sanitizers see the source
+        volatile uint8_t sink = 0;
+        for (uint16_t i = 0; i < size; i++)
+        {
+            sink ^= value[i];
+        }
+
+        if (_failWrites > 0)
+        {
+            _failWrites--;
+            return BLE_ERROR_NO_MEM;
+        }
+
+        characteristic->setValue(0, value, size);
+        return BLE_ERROR_NONE;
+    }
+
+    ble_error_t read(GattAttribute::Handle_t handle, uint8_t buffer[], uint16_t* lengthP)
+    {
+        GattCharacteristic* characteristic = find(handle);
+        if (characteristic == NULL)
+        {
+            return BLE_ERROR_INVALID_PARAM;
+        }
+
+        uint16_t len = characteristic->getValueLength();
+        if (len > *lengthP)
+        {
+            len = *lengthP;
+        }
+
+        memcpy(buffer, characteristic->getValue(), len);
+        *lengthP = len;
+        return BLE_ERROR_NONE;
+    }
+
+    GattCharacteristic* find(GattAttribute::Handle_t handle)
+    {
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            if (_characteristics[i]->getValueHandle() == handle)
+            {
+                return _characteristics[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    template <typename T>
+    void onDataWritten(T* object, void (T::*method)(const GattWriteCallbackParams*))
+    {
+        _dataWritten.attach(object, method);
+    }
+
+    void onUpdatesEnabled(void (*function)(GattAttribute::Handle_t))
+    {
+        _updatesEnabled.attach(function);
+    }
+
+    /** A write from the central: the stack updates the value first, except for queued fragments */
+    void dataWritten(const GattWriteCallbackParams* params)
+    {
+        GattCharacteristic* characteristic = find(params->handle);
+        if (characteristic != NULL && params->len > 0 &&
+            params->writeOp != GattWriteCallbackParams::OP_PREP_WRITE_REQ &&
+            params->writeOp != GattWriteCallbackParams::OP_EXEC_WRITE_REQ_CANCEL)
+        {
+            characteristic->setValue(params->offset, params->data, params->len);
+        }
+
+        _dataWritten.call(params);
+    }
+
+    /**
+     * A long write the stack queued itself, as nRF5x does when the
+     * application gives no memory block for it: the fragments land in the
+     * value and only an empty execute write reaches the application.
+     */
+    void queuedWrite(GattAttribute::Handle_t handle, const uint8_t* value, uint16_t len)
+    {
+        GattCharacteristic* characteristic = find(handle);
+        if (characteristic == NULL || !characteristic->setValue(0, value, len))
+        {
+            return;
+        }
+
+        GattWriteCallbackParams params = { 0, handle, GattWriteCallbackParams::OP_EXEC_WRITE_REQ_NOW, 0, 0, NULL };
+        _dataWritten.call(&params);
+    }
+
+    void updatesEnabled(GattAttribute::Handle_t handle)
+    {
+        _updatesEnabled.call(handle);
+    }
+
+    /** Between iterations: registrations stay, injected failures do not */
+    void reset()
+    {
+        _failWrites = 0;
+    }
+
+private:
+    GattCharacteristic* _characteristics[STUB_MAX_CHARACTERISTICS];
+    uint8_t _count;
+    GattAttribute::Handle_t _nextHandle;
+    uint8_t _failWrites;
+    StubCallback<const GattWriteCallbackParams*> _dataWritten;
+    StubCallback<GattAttribute::Handle_t> _updatesEnabled;
+};
+
+
+class Gap
+{
+public:
+    typedef uint16_t Handle_t;
+    typedef uint8_t Address_t[6];
+
+    enum AddressType_t
+    {
+        ADDR_TYPE_PUBLIC = 0,
+        ADDR_TYPE_RANDOM_STATIC
+    };
+
+    struct ConnectionCallbackParams_t
+    {
+        Handle_t handle;
+    };
+
+    struct DisconnectionCallbackParams_t
+    {
+        Handle_t handle;
+        uint8_t reason;
+    };
+
+    template <typename T>
+    void onConnection(T* object, void (T::*method)(const ConnectionCallbackParams_t*))
+    {
+        _connection.attach(object, method);
+    }
+
+    template <typename T>
+    void onDisconnection(T* object, void (T::*method)(const DisconnectionCallbackParams_t*))
+    {
+        _disconnection.attach(object, method);
+    }
+
+    ble_error_t getAddress(AddressType_t* type, Address_t address)
+    {
+        static const Address_t stubAddress = {0x01, 0x23, 0x45, 0x67, 0x89, 0xC0};
+        *type = ADDR_TYPE_RANDOM_STATIC;
+        memcpy(address, stubAddress, sizeof(Address_t));
+        return BLE_ERROR_NONE;
+    }
+
+    void connected(Handle_t handle)
+    {
+        ConnectionCallbackParams_t params = { handle };
+        _connection.call(&params);
+    }
+
+    void disconnected(Handle_t handle, uint8_t reason)
+    {
+        DisconnectionCallbackParams_t params = { handle, reason };
+        _disconnection.call(&params);
+    }
+
+private:
+    StubCallback<const ConnectionCallbackParams_t*> _connection;
+    StubCallback<const DisconnectionCallbackParams_t*> _disconnection;
+};
+
+
+class SecurityManager
+{
+public:
+    enum SecurityCompletionStatus_t
+    {
+        SEC_STATUS_SUCCESS = 0x00,
+        SEC_STATUS_TIMEOUT = 0x01,
+        SEC_STATUS_UNSPECIFIED = 0x88
+    };
+
+    typedef void (*SecuritySetupCompletedCallback_t)(Gap::Handle_t, SecurityCompletionStatus_t);
+
+    SecurityManager() :
+        _completed(NULL)
+    {
+    }
+
+    void onSecuritySetupCompleted(SecuritySetupCompletedCallback_t callback)
+    {
+        _completed = callback;
+    }
+
+    void securitySetupCompleted(Gap::Handle_t handle, SecurityCompletionStatus_t status)
+    {
+        if (_completed != NULL)
+        {
+            _completed(handle, status);
+        }
+    }
+
+private:
+    SecuritySetupCompletedCallback_t _completed;
+};
+
+
+class BLE
+{
+public:
+    static BLE& Instance()
+    {
+        static BLE instance;
+        return instance;
+    }
+
+    Gap& gap()
+    {
+        return _gap;
+    }
+
+    GattServer& gattServer()
+    {
+        return _gattServer;
+    }
+
+    SecurityManager& securityManager()
+    {
+        return _securityManager;
+    }
+
+private:
+    Gap _gap;
+    GattServer _gattServer;
+    SecurityManager _securityManager;
+};
+
+typedef BLE BLEDevice;
+
+#endif /* #ifndef __STUB_BLE_H__ */
@@ -0,0 +1,74 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_MBED_CRC_H__
+#define __STUB_MBED_CRC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+enum crc_polynomial
+{
+    POLY_32BIT_ANSI = 0x04C11DB7
+};
+
+template <uint32_t polynomial, int width>
+class MbedCRC;
+
+/** CRC-32 as mbed computes it for POLY_32BIT_ANSI: reflected, initial and final value 0xFFFFFFFF */
+template <>
+class MbedCRC<POLY_32BIT_ANSI, 32>
+{
+public:
+    int32_t compute_partial_start(uint32_t* crc)
+    {
+        *crc = 0xFFFFFFFF;
+        return 0;
+    }
+
+    int32_t compute_partial(void* buffer, uint32_t size, uint32_t* crc)
+    {
+        const uint8_t* data = (const uint8_t*)buffer;
+        uint32_t value = *crc;
+        for (uint32_t i = 0; i < size; i++)
+        {
+            value ^= data[i];
+            for (int bit = 0; bit < 8; bit++)
+            {
+                value = (value >> 1) ^ (0xEDB88320 & (0 - (value & 1)));
+            }
+        }
+
+        *crc = value;
+        return 0;
+    }
+
+    int32_t compute_partial_stop(uint32_t* crc)
+    {
+        *crc ^= 0xFFFFFFFF;
+        return 0;
+    }
+
+    int32_t compute(void* buffer, uint32_t size, uint32_t* crc)
+    {
+        compute_partial_start(crc);
+        compute_partial(buffer, size, crc);
+        return compute_partial_stop(crc);
+    }
+};
+
+#endif /* #ifndef __STUB_MBED_CRC_H__ */
@@ -0,0 +1,236 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_MBED_EVENTS_H__
+#define __STUB_MBED_EVENTS_H__
+
+#include <new>
+#include <stdint.h>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+#include "rtos/Kernel.h"
+
+
+#define EVENTS_EVENT_SIZE       64
+#define STUB_EVENT_SLOTS        8
+
+
+/**
+ * Fixed size, single threaded event queue. Nothing runs on its own: the
+ * driver dispatches the next event (moving the virtual clock to its due
+ * time) or advances the clock, so the order is fully reproducible.
+ */
+class EventQueue
+{
+public:
+    EventQueue(unsigned size = 0, unsigned char* buffer = NULL)
+    {
+        clear();
+    }
+
+    template <typename T, typename R, typename... P, typename... A>
+    int call(T* object, R (T::*method)(P...), A... args)
+    {
+        return call_in(0, object, method, args...);
+    }
+
+    /** Member calls only, with their arguments copied into the slot like equeue does */
+    template <typename T, typename R, typename... P, typename... A>
+    int call_in(int ms, T* object, R (T::*method)(P...), A... args)
+    {
+        typedef MemberCall<T, R, P...> Call;
+        static_assert(sizeof(Call) <= sizeof(((Slot*)NULL)->storage), "event too large");
+        static_assert(TriviallyCopyable<P...>::value, "slots are copied as bytes");
+
+        for (int i = 0; i < STUB_EVENT_SLOTS; i++)
+        {
+            Slot& slot = _slots[i];
+            if (slot.id != 0)
+            {
+                continue;
+            }
+
+            new (slot.storage) Call(object, method, args...);
+            slot.id = _nextId++;
+            slot.due = rtos::Kernel::clock() + (ms > 0 ? ms : 0);
+            slot.thunk = &Call::invoke;
+            return slot.id;
+        }
+
+        // Full, as equeue_alloc would be
+        return 0;
+    }
+
+    /** Never run on the host: the driver dispatches, see dispatchNext() */
+    void dispatch_forever()
+    {
+    }
+
+    bool cancel(int id)
+    {
+        for (int i = 0; i < STUB_EVENT_SLOTS; i++)
+        {
+            if (id != 0 && _slots[i].id == id)
+            {
+                _slots[i].id = 0;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /** Run the earliest event, moving the clock up to it; false if none */
+    bool dispatchNext()
+    {
+        int next = -1;
+        for (int i = 0; i < STUB_EVENT_SLOTS; i++)
+        {
+            if (_slots[i].id != 0 && (next < 0 || _slots[i].due < _slots[next].due ||
+                (_slots[i].due == _slots[next].due && _slots[i].id < _slots[next].id)))
+            {
+                next = i;
+            }
+        }
+
+        if (next < 0)
+        {
+            return false;
+        }
+
+        Slot slot = _slots[next];
+        _slots[next].id = 0;
+        if (slot.due > rtos::Kernel::clock())
+        {
+            rtos::Kernel::clock() = slot.due;
+        }
+
+        slot.thunk(slot.storage);
+        return true;
+    }
+
+    /** Move the clock, running everything that falls due on the way */
+    void advance(uint32_t ms)
+    {
+        uint64_t until = rtos::Kernel::clock() + ms;
+        while (pendingBefore(until))
+        {
+            dispatchNext();
+        }
+
+        rtos::Kernel::clock() = until;
+    }
+
+    int pending() const
+    {
+        int count = 0;
+        for (int i = 0; i < STUB_EVENT_SLOTS; i++)
+        {
+            count += _slots[i].id != 0;
+        }
+
+        return count;
+    }
+
+    void clear()
+    {
+        memset(_slots, 0, sizeof(_slots));
+        _nextId = 1;
+    }
+
+private:
+    template <typename... P>
+    struct TriviallyCopyable : std::true_type
+    {
+    };
+
+    template <typename P0, typename... P>
+    struct TriviallyCopyable<P0, P...> : std::integral_constant<bool,
+        std::is_trivially_copyable<typename std::decay<P0>::type>::value && TriviallyCopyable<P...>::value>
+    {
+    };
+
+    template <size_t... I>
+    struct Indices
+    {
+    };
+
+    template <size_t N, size_t... I>
+    struct MakeIndices : MakeIndices<N - 1, N - 1, I...>
+    {
+    };
+
+    template <size_t... I>
+    struct MakeIndices<0, I...>
+    {
+        typedef Indices<I...> type;
+    };
+
+    template <typename T, typename R, typename... P>
+    struct MemberCall
+    {
+        template <typename... A>
+        MemberCall(T* object, R (T::*method)(P...), A... args) :
+            object(object),
+            method(method),
+            args(args...)
+        {
+        }
+
+        static void invoke(void* storage)
+        {
+            MemberCall* call = (MemberCall*)storage;
+            call->apply(typename MakeIndices<sizeof...(P)>::type());
+        }
+
+        template <size_t... I>
+        void apply(Indices<I...>)
+        {
+            (object->*method)(std::get<I>(args)...);
+        }
+
+        T* object;
+        R (T::*method)(P...);
+        std::tuple<typename std::decay<P>::type...> args;
+    };
+
+    struct Slot
+    {
+        int id;
+        uint64_t due;
+        void (*thunk)(void*);
+        alignas(8) char storage[48];
+    };
+
+    bool pendingBefore(uint64_t until) const
+    {
+        for (int i = 0; i < STUB_EVENT_SLOTS; i++)
+        {
+            if (_slots[i].id != 0 && _slots[i].due <= until)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    Slot _slots[STUB_EVENT_SLOTS];
+    int _nextId;
+};
+
+#endif /* #ifndef __STUB_MBED_EVENTS_H__ */
@@ -0,0 +1,224 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_MBED_H__
+#define __STUB_MBED_H__
+
+/*
+ * Host stand-in for the parts of mbed-os the handshake path and the
+ * firmware service use, just enough to compile them off target.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define MBED_PACKED(declaration)        declaration __attribute__((packed))
+#define MBED_STATIC_ASSERT(expr, msg)   static_assert(expr, msg)
+
+typedef void* osThreadId_t;
+typedef int32_t osStatus;
+
+enum osPriority_t
+{
+    osPriorityBelowNormal = 16,
+    osPriorityNormal = 24
+};
+
+static inline void error(const char* format, ...)
+{
+    abort();
+}
+
+
+template <typename F>
+class Callback;
+
+/** Free function callbacks only, which is all the handshake takes */
+template <typename R, typename A0>
+class Callback<R(A0)>
+{
+public:
+    Callback(R (*function)(A0) = NULL) :
+        _function(function)
+    {
+    }
+
+    operator bool() const
+    {
+        return _function != NULL;
+    }
+
+    R operator()(A0 a0) const
+    {
+        return _function(a0);
+    }
+
+private:
+    R (*_function)(A0);
+};
+
+/** Object + member function, for thread entry points */
+template <typename R>
+class Callback<R()>
+{
+public:
+    Callback() :
+        _object(NULL),
+        _thunk(NULL)
+    {
+    }
+
+    template <typename T>
+    Callback(T* object, R (T::*method)()) :
+        _object(object),
+        _thunk(&invoke<T>)
+    {
+        static_assert(sizeof(method) <= sizeof(_method), "member function pointer too large");
+        memcpy(_method, &method, sizeof(method));
+    }
+
+    operator bool() const
+    {
+        return _thunk != NULL;
+    }
+
+    R operator()() const
+    {
+        return _thunk(_object, _method);
+    }
+
+private:
+    template <typename T>
+    static R invoke(void* object, const char* method)
+    {
+        R (T::*m)();
+        memcpy(&m, method, sizeof(m));
+        return (((T*)object)->*m)();
+    }
+
+    void* _object;
+    R (*_thunk)(void*, const char*);
+    char _method[2 * sizeof(void*)];
+};
+
+template <typename T, typename R>
+Callback<R()> callback(T* object, R (T::*method)())
+{
+    return Callback<R()>(object, method);
+}
+
+
+/**
+ * Never scheduled: a thread's work reaches it through an EventQueue, and
+ * the host driver dispatches that queue itself, which is what sequencing
+ * the two threads deterministically needs.
+ */
+class Thread
+{
+public:
+    Thread(osPriority_t priority = osPriorityNormal, uint32_t stack_size = 4096, unsigned char* stack_mem = NULL, const char* name = NULL)
+    {
+    }
+
+    osStatus start(Callback<void()> task)
+    {
+        _task = task;
+        return 0;
+    }
+
+    osThreadId_t get_id() const
+    {
+        return (osThreadId_t)this;
+    }
+
+private:
+    Callback<void()> _task;
+};
+
+
+/** Busy waits are only added up, see stubWaitedUs() */
+static inline uint64_t& stubWaitedUs()
+{
+    static uint64_t us = 0;
+    return us;
+}
+
+static inline void wait_us(int us)
+{
+    stubWaitedUs() += us;
+}
+
+
+/** Wall clock, unlike the virtual one in rtos::Kernel: only the benchmark times with it */
+class Timer
+{
+public:
+    Timer() :
+        _start(0),
+        _elapsed(0),
+        _running(false)
+    {
+    }
+
+    void start()
+    {
+        _start = nowUs();
+        _running = true;
+    }
+
+    void stop()
+    {
+        if (_running)
+        {
+            _elapsed += nowUs() - _start;
+            _running = false;
+        }
+    }
+
+    void reset()
+    {
+        _start = nowUs();
+        _elapsed = 0;
+    }
+
+    int read_us()
+    {
+        return (int)(_elapsed + (_running ? nowUs() - _start : 0));
+    }
+
+    int read_ms()
+    {
+        return read_us() / 1000;
+    }
+
+private:
+    static uint64_t nowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    uint64_t _start;
+    uint64_t _elapsed;
+    bool _running;
+};
+
+#endif /* #ifndef __STUB_MBED_H__ */
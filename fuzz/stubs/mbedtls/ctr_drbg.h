@@ -0,0 +1,83 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_CTR_DRBG_H__
+#define __STUB_CTR_DRBG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+#define MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED  -0x0034
+#define MBEDTLS_CTR_DRBG_ENTROPY_LEN                48
+
+
+/**
+ * Same calling contract as mbedtls (seeding pulls ENTROPY_LEN bytes and
+ * fails with the source), but the output is a cheap xorshift stream: the
+ * fuzzer is after the handshake logic, not after AES.
+ */
+typedef struct
+{
+    uint64_t state;
+} mbedtls_ctr_drbg_context;
+
+static inline void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context* ctx)
+{
+    ctx->state = 0;
+}
+
+static inline void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context* ctx)
+{
+    ctx->state = 0;
+}
+
+static inline int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context* ctx,
+    int (*f_entropy)(void*, unsigned char*, size_t), void* p_entropy,
+    const unsigned char* custom, size_t len)
+{
+    unsigned char seed[MBEDTLS_CTR_DRBG_ENTROPY_LEN];
+    if (f_entropy(p_entropy, seed, sizeof(seed)) != 0)
+    {
+        return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+    }
+
+    ctx->state = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < sizeof(seed); i++)
+    {
+        ctx->state = (ctx->state ^ seed[i]) * 0x100000001B3ULL;
+    }
+    ctx->state |= 1;
+
+    return 0;
+}
+
+static inline int mbedtls_ctr_drbg_random(void* p_rng, unsigned char* output, size_t len)
+{
+    mbedtls_ctr_drbg_context* ctx = (mbedtls_ctr_drbg_context*)p_rng;
+    for (size_t i = 0; i < len; i++)
+    {
+        ctx->state ^= ctx->state << 13;
+        ctx->state ^= ctx->state >> 7;
+        ctx->state ^= ctx->state << 17;
+        output[i] = (unsigned char)ctx->state;
+    }
+
+    return 0;
+}
+
+#endif /* #ifndef __STUB_CTR_DRBG_H__ */
@@ -0,0 +1,38 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_MBED_STATS_H__
+#define __STUB_MBED_STATS_H__
+
+#include <stdint.h>
+
+// Heap stats for the host benchmark, which counts its own allocations;
+// the "diagnostics" and "stack-monitor" users are left off on the host
+#if defined(MBED_HEAP_STATS_ENABLED)
+typedef struct
+{
+    uint32_t current_size;
+    uint32_t max_size;
+    uint32_t total_size;
+    uint32_t reserved_size;
+    uint32_t alloc_cnt;
+    uint32_t alloc_fail_cnt;
+} mbed_stats_heap_t;
+
+void mbed_stats_heap_get(mbed_stats_heap_t* stats);
+#endif
+
+#endif /* #ifndef __STUB_MBED_STATS_H__ */
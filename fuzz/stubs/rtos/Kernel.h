@@ -0,0 +1,43 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STUB_RTOS_KERNEL_H__
+#define __STUB_RTOS_KERNEL_H__
+
+#include <stdint.h>
+
+
+namespace rtos {
+
+/** Virtual clock, only moved by the stub EventQueue */
+class Kernel
+{
+public:
+    static uint64_t get_ms_count()
+    {
+        return clock();
+    }
+
+    static uint64_t& clock()
+    {
+        static uint64_t ms = 0;
+        return ms;
+    }
+};
+
+}
+
+#endif /* #ifndef __STUB_RTOS_KERNEL_H__ */
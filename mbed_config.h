@@ -22,6 +22,17 @@
 #define __MBED_CONFIG_DATA__
 
 // Configuration parameters
+#define MBED_CONF_APP_STACK_MONITOR                                           0                                                                                                // set by application
+#define MBED_CONF_APP_PROFILING                                               0                                                                                                // set by application
+#define MBED_CONF_APP_FIRMWARE_BANK_ADDRESS                                   0x40000                                                                                          // set by application
+#define MBED_CONF_APP_FIRMWARE_BANK_SIZE                                      0x3C000                                                                                          // set by application
+#define MBED_CONF_APP_FIRMWARE_UPDATE                                         0                                                                                                // set by application
+#define MBED_CONF_APP_ALIVENESS_PULSE_INTERVAL                                0                                                                                                // set by application
+#define MBED_CONF_APP_BATTERY_SIMULATION                                      0                                                                                                // set by application
+#define MBED_CONF_APP_BENCHMARK                                               0                                                                                                // set by application
+#define MBED_CONF_APP_DIAGNOSTICS                                             0                                                                                                // set by application
+#define MBED_CONF_APP_LOG                                                     1                                                                                                // set by application
+#define MBED_CONF_APP_NONCE_POOL_SEED                                         0                                                                                                // set by application
 #define MBED_CONF_NORDIC_UART_DMA_SIZE                                        8                                                                                                // set by library:nordic
 #define MBED_CONF_NANOSTACK_HAL_CRITICAL_SECTION_USABLE_FROM_INTERRUPT        0                                                                                                // set by library:nanostack-hal
 #define MBED_CONF_EVENTS_SHARED_STACKSIZE                                     1024                                                                                             // set by library:events
@@ -17,24 +17,68 @@
 #ifndef __BLE_BATTERY_SERVICE_H__
 #define __BLE_BATTERY_SERVICE_H__
 
+#include <events/mbed_events.h>
 #include "ble/BLE.h"
+#include "Diagnostics.h"
+#include "Log.h"
 
 
 #define BATTERY_SERVICE_UUID                "0000180f00001000800000805f9b34fb"
 #define LEVEL_CHARACTERISTIC_UUID           "00002a1900001000800000805f9b34fb"
 
+#define BATTERY_SAMPLE_INTERVAL_MS          (10 * 60 * 1000)
+#define BATTERY_BATCH_SIZE                  4
+#define BATTERY_FILTER_SHIFT                2       // EMA weight 1/4
+#define BATTERY_HYSTERESIS_PCT              2
+
+// The Battery Service is only exposed with a real (or explicitly simulated) supply reading
+#if defined(TARGET_NRF52) || MBED_CONF_APP_BATTERY_SIMULATION
+#define BATTERY_LEVEL_SOURCE                1
+#else
+#define BATTERY_LEVEL_SOURCE                0
+#endif
+
+
+/** Coin cell discharge curve, supply voltage to remaining capacity */
+struct BatteryCurvePoint
+{
+    uint16_t mV;
+    uint8_t  percent;
+};
+
+const static BatteryCurvePoint BATTERY_CURVE[] = {
+    { 3000, 100 },
+    { 2900,  80 },
+    { 2800,  60 },
+    { 2700,  40 },
+    { 2600,  20 },
+    { 2500,  10 },
+    { 2400,   5 },
+    { 2000,   0 }
+};
+
+
+#if BATTERY_LEVEL_SOURCE
 
 class BatteryService {
 public:
 
-    BatteryService(BLEDevice &ble) :
+    BatteryService(BLEDevice &ble, EventQueue &eventQueue) :
         _ble(ble),
-        _levelChar(LEVEL_CHARACTERISTIC_UUID, &_level)
+        _eventQueue(eventQueue),
+        _levelChar(LEVEL_CHARACTERISTIC_UUID, &_level, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY),
+        _level(0),
+        _filteredMv(0),
+        _reported(false)
     {
         GattCharacteristic *charTable[] = {&_levelChar};
         GattService         batteryService(BATTERY_SERVICE_UUID, charTable, sizeof(charTable) / sizeof(GattCharacteristic *));
         ble_error_t res = ble.gattServer().addService(batteryService);
-        printf("BatteryService: %d\n", res);
+        PGP_LOG("BatteryService: %d\n", res);
+
+        // First reading right away, then only every few minutes
+        sample();
+        _eventQueue.call_every(BATTERY_SAMPLE_INTERVAL_MS, this, &BatteryService::sample);
     }
 
     GattAttribute::Handle_t levelHandle() const
@@ -42,11 +86,127 @@ public:
         return _levelChar.getValueHandle();
     }
 
+private:
+    /**
+     * Take a batch of readings in one wakeup, filter them and only touch the
+     * attribute (and notify) when the level moved past the hysteresis.
+     */
+    void sample()
+    {
+        Diagnostics::wakeup(WAKEUP_BATTERY);
+
+        uint32_t sum = 0;
+        for (int i = 0; i < BATTERY_BATCH_SIZE; i++)
+        {
+            sum += readSupplyMv();
+        }
+
+        uint16_t mV = sum / BATTERY_BATCH_SIZE;
+        if (_filteredMv == 0)
+        {
+            _filteredMv = mV;
+        }
+        else
+        {
+            _filteredMv += ((int32_t)mV - (int32_t)_filteredMv) >> BATTERY_FILTER_SHIFT;
+        }
+
+        uint8_t level = toPercent(_filteredMv);
+        int delta = (int)level - (int)_level;
+        if (_reported && delta < BATTERY_HYSTERESIS_PCT && delta > -BATTERY_HYSTERESIS_PCT)
+        {
+            return;
+        }
+
+        _level = level;
+        _reported = true;
+        _ble.gattServer().write(levelHandle(), &_level, sizeof(_level));
+    }
+
+    static uint8_t toPercent(uint16_t mV)
+    {
+        const size_t points = sizeof(BATTERY_CURVE) / sizeof(BATTERY_CURVE[0]);
+        if (mV >= BATTERY_CURVE[0].mV)
+        {
+            return BATTERY_CURVE[0].percent;
+        }
+
+        for (size_t i = 1; i < points; i++)
+        {
+            const BatteryCurvePoint& hi = BATTERY_CURVE[i - 1];
+            const BatteryCurvePoint& lo = BATTERY_CURVE[i];
+            if (mV >= lo.mV)
+            {
+                return lo.percent + (uint8_t)((uint32_t)(mV - lo.mV) * (hi.percent - lo.percent) / (hi.mV - lo.mV));
+            }
+        }
+
+        return BATTERY_CURVE[points - 1].percent;
+    }
+
+#if !MBED_CONF_APP_BATTERY_SIMULATION
+    /** VDD through the SAADC, 16x hardware oversampled in a single burst */
+    static uint16_t readSupplyMv()
+    {
+        volatile int16_t result = 0;
+
+        NRF_SAADC->RESOLUTION = SAADC_RESOLUTION_VAL_12bit;
+        NRF_SAADC->OVERSAMPLE = SAADC_OVERSAMPLE_OVERSAMPLE_Over16x;
+        NRF_SAADC->CH[0].PSELP = SAADC_CH_PSELP_PSELP_VDD;
+        NRF_SAADC->CH[0].PSELN = SAADC_CH_PSELN_PSELN_NC;
+        NRF_SAADC->CH[0].CONFIG =
+            (SAADC_CH_CONFIG_GAIN_Gain1_6 << SAADC_CH_CONFIG_GAIN_Pos) |
+            (SAADC_CH_CONFIG_REFSEL_Internal << SAADC_CH_CONFIG_REFSEL_Pos) |
+            (SAADC_CH_CONFIG_TACQ_10us << SAADC_CH_CONFIG_TACQ_Pos) |
+            (SAADC_CH_CONFIG_MODE_SE << SAADC_CH_CONFIG_MODE_Pos) |
+            (SAADC_CH_CONFIG_BURST_Enabled << SAADC_CH_CONFIG_BURST_Pos);
+        NRF_SAADC->RESULT.PTR = (uint32_t)&result;
+        NRF_SAADC->RESULT.MAXCNT = 1;
+        NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Enabled;
+
+        NRF_SAADC->EVENTS_STARTED = 0;
+        NRF_SAADC->TASKS_START = 1;
+        while (!NRF_SAADC->EVENTS_STARTED);
+
+        NRF_SAADC->EVENTS_END = 0;
+        NRF_SAADC->TASKS_SAMPLE = 1;
+        while (!NRF_SAADC->EVENTS_END);
+
+        NRF_SAADC->EVENTS_STOPPED = 0;
+        NRF_SAADC->TASKS_STOP = 1;
+        while (!NRF_SAADC->EVENTS_STOPPED);
+
+        NRF_SAADC->CH[0].PSELP = SAADC_CH_PSELP_PSELP_NC;
+        NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+
+        // 0.6 V reference, 1/6 gain, 12 bits
+        return result < 0 ? 0 : (uint16_t)(((uint32_t)result * 3600) >> 12);
+    }
+#else
+    /** "battery-simulation": 3.0 V falling 1 mV per hour of uptime, with noise */
+    static uint16_t readSupplyMv()
+    {
+        static uint32_t noise = 0x2545F491;
+        noise ^= noise << 13;
+        noise ^= noise >> 17;
+        noise ^= noise << 5;
+
+        uint32_t hours = Diagnostics::now() / (60 * 60 * 1000);
+        uint32_t mV = hours < 1000 ? 3000 - hours : 2000;
+        return (uint16_t)(mV + (noise % 9) - 4);
+    }
+#endif
+
 private:
     BLEDevice& _ble;
+    EventQueue& _eventQueue;
     ReadOnlyGattCharacteristic<uint8_t> _levelChar;
 
     uint8_t _level;
+    uint16_t _filteredMv;
+    bool _reported;
 };
 
+#endif /* #if BATTERY_LEVEL_SOURCE */
+
 #endif /* #ifndef __BLE_LED_SERVICE_H__ */
@@ -0,0 +1,246 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include <mbed.h>
+#include "platform/mbed_stats.h"
+#include "CertificateService.h"
+#include "Handshake.h"
+
+
+#define BENCHMARK_WARMUP            16
+#ifndef BENCHMARK_ITERATIONS
+#define BENCHMARK_ITERATIONS        256
+#endif
+
+
+#if MBED_CONF_APP_BENCHMARK && !defined(MBED_HEAP_STATS_ENABLED)
+#error "The benchmark option needs MBED_HEAP_STATS_ENABLED, allocation limits cannot be checked without it"
+#endif
+
+
+/**
+ * Upper bounds a benchmark must stay under, recorded from the output of a
+ * known-good run built with "log" disabled. A limit of 0 means nothing was
+ * recorded yet: the result is reported as "unbaselined" and cannot fail the
+ * run, while the allocation limit still applies.
+ */
+struct BenchmarkBaseline
+{
+    const char* name;
+    uint32_t    limit;      // ns per op, or ms for a phone handshake
+    int32_t     allocs;     // per run, -1 to ignore
+};
+
+#if defined(BENCHMARK_HOST)
+// fuzz/benchmark_host.cpp on the stub stack, g++ -O2, x86-64: three times
+// the slowest of five recorded runs, at least 20 ns, so noise does not fail it
+static const BenchmarkBaseline BENCHMARK_BASELINES[] = {
+    { "certificate_send",       33, 0 },        // recorded 8-11
+    { "certificate_receive",    27, 0 },        // 7-9
+    { "handshake_update_idle",  20, 0 },        // 0-1
+    { "handshake_update_step",  20, 0 },        // 3-5
+    { "sfida_payload",          300, 0 },       // 40-97
+    { "get_mac",                20, 0 },        // 0-1
+    { "connect_to_resp",        12000, 0 },     // 3833-3971, ns per corpus replay
+};
+#else
+// Not recorded on the target yet, the host suite guards the code paths
+static const BenchmarkBaseline BENCHMARK_BASELINES[] = {
+    { "certificate_send",       0, 0 },
+    { "certificate_receive",    0, 0 },
+    { "handshake_update_idle",  0, 0 },
+    { "handshake_update_step",  0, 0 },
+    { "sfida_payload",          0, 0 },
+    { "get_mac",                0, 0 },
+    { "connect_to_resp",        0, -1 },
+};
+#endif
+
+
+/**
+ * Benchmark suite for the pairing hot path, on the target or on the host
+ * stubs (fuzz/benchmark_host.cpp).
+ *
+ * Each micro benchmark runs a fixed warmup, then a fixed number of timed
+ * iterations, and prints one JSON object per line. Results are checked
+ * against BENCHMARK_BASELINES and a final summary line reports PASS/FAIL.
+ * The Diagnostics and Profiler figures the suite inflates are cleared
+ * afterwards. Given a connectToResp case (the host replays the corpus
+ * handshake) connect-to-RESP_00_00_00_00 is timed like the others;
+ * otherwise it is reported for every handshake with a real phone.
+ */
+class Benchmark
+{
+public:
+    typedef void (*Case)();
+
+    static int Run(Handshake* handshake, CertificateService* certificateService, Case connectToResp = NULL)
+    {
+        _handshake = handshake;
+        _certificateService = certificateService;
+
+        int failures = 0;
+        failures += !measure("certificate_send", &Benchmark::certificateSend);
+        failures += !measure("certificate_receive", &Benchmark::certificateReceive);
+        failures += !measure("handshake_update_idle", &Benchmark::handshakeUpdateIdle);
+        failures += !measure("handshake_update_step", &Benchmark::handshakeUpdateStep);
+        failures += !measure("sfida_payload", &Benchmark::sfidaPayload);
+        failures += !measure("get_mac", &Benchmark::getMAC);
+        if (connectToResp != NULL)
+        {
+            failures += !measure("connect_to_resp", connectToResp);
+        }
+
+        // Leave the handshake and the counters as we found them for the real connection
+        _handshake->reset();
+        if (connectToResp == NULL)
+        {
+            _handshake->onCompleted(&Benchmark::onHandshakeCompleted);
+        }
+        Diagnostics::reset();
+        Profiler::reset();
+
+        printf("{\"summary\":\"%s\",\"regressions\":%d}\n", failures ? "FAIL" : "PASS", failures);
+        return failures;
+    }
+
+private:
+    static void certificateSend()
+    {
+        // The borrowing overload, as Handshake sends
+        uint8_t command[SFIDA_COMMAND_LEN] = {0, 0, 0, 0};
+        MessageSegment segment = { _payload, sizeof(_payload) };
+        _certificateService->send(command, &segment, 1);
+    }
+
+    static void certificateReceive()
+    {
+        // A pairing response split over two write commands
+        GattWriteCallbackParams params;
+        memset(&params, 0, sizeof(params));
+        params.handle = _certificateService->centralToSfidaHandle();
+        params.writeOp = GattWriteCallbackParams::OP_WRITE_CMD;
+        params.len = PAIRING_RESPONSE_LEN / 2;
+        params.data = _payload;
+
+        _certificateService->expectFrame(PAIRING_RESPONSE_LEN);
+        _certificateService->onDataWritten(&params);
+        _certificateService->onDataWritten(&params);
+        _certificateService->frame();
+    }
+
+    static void handshakeUpdateIdle()
+    {
+        _handshake->update();
+    }
+
+    static void handshakeUpdateStep()
+    {
+        _handshake->reset();
+        _handshake->_pendingState = Handshake::CONNECTED;
+        _handshake->update();
+    }
+
+    static void sfidaPayload()
+    {
+        // The event queue is not running yet: mark the pool full instead of
+        // timing the DRBG, the nonce contents do not matter here
+        _handshake->_noncePool->_ready = NONCE_POOL_DEPTH;
+        _handshake->onSfidaSubscribed();
+    }
+
+    static void getMAC()
+    {
+        _handshake->getMAC(_payload);
+    }
+
+    static bool measure(const char* name, Case run)
+    {
+        for (int i = 0; i < BENCHMARK_WARMUP; i++)
+        {
+            run();
+        }
+
+        uint32_t allocs = allocCount();
+
+        Timer timer;
+        timer.start();
+        for (int i = 0; i < BENCHMARK_ITERATIONS; i++)
+        {
+            run();
+        }
+        timer.stop();
+
+        allocs = allocCount() - allocs;
+
+        uint32_t nsPerOp = (uint32_t)(((uint64_t)timer.read_us() * 1000) / BENCHMARK_ITERATIONS);
+        return report(name, BENCHMARK_ITERATIONS, nsPerOp, "ns_per_op", (int32_t)allocs);
+    }
+
+    static bool report(const char* name, uint32_t iterations, uint32_t value, const char* unit, int32_t allocs)
+    {
+        const BenchmarkBaseline* baseline = NULL;
+        for (size_t i = 0; i < sizeof(BENCHMARK_BASELINES) / sizeof(BENCHMARK_BASELINES[0]); i++)
+        {
+            if (strcmp(BENCHMARK_BASELINES[i].name, name) == 0)
+            {
+                baseline = &BENCHMARK_BASELINES[i];
+                break;
+            }
+        }
+
+        bool recorded = baseline != NULL && baseline->limit != 0;
+        bool ok = baseline == NULL ||
+            ((!recorded || value <= baseline->limit) && (baseline->allocs < 0 || allocs <= baseline->allocs));
+
+        printf("{\"bench\":\"%s\",\"iterations\":%lu,\"%s\":%lu,\"allocs\":%ld,\"baseline\":%lu,\"status\":\"%s\"}\n",
+            name,
+            (unsigned long)iterations,
+            unit,
+            (unsigned long)value,
+            (long)allocs,
+            baseline ? (unsigned long)baseline->limit : 0UL,
+            !ok ? "regression" : recorded ? "ok" : "unbaselined");
+
+        return ok;
+    }
+
+    static void onHandshakeCompleted(uint32_t ms)
+    {
+        report("connect_to_resp", 1, ms, "ms", 0);
+    }
+
+    static uint32_t allocCount()
+    {
+#if defined(MBED_HEAP_STATS_ENABLED)
+        mbed_stats_heap_t heap;
+        mbed_stats_heap_get(&heap);
+        return heap.alloc_cnt;
+#else
+        // Only reached with the benchmark option off, see the #error above
+        return 0;
+#endif
+    }
+
+    static Handshake* _handshake;
+    static CertificateService* _certificateService;
+    static uint8_t _payload[SFIDA_TO_CENTRAL_MAX_LEN - SFIDA_COMMAND_LEN];
+};
+
+#endif /* #ifndef __BENCHMARK_H__ */
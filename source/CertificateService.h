@@ -18,6 +18,9 @@
 #define __BLE_CERTIFICATE_SERVICE_H__
 
 #include "ble/BLE.h"
+#include "Diagnostics.h"
+#include "Log.h"
+#include "Profiler.h"
 
 
 #define CERTIFICATE_SERVICE_UUID                "bbe877095b894433ab7f8b8eef0d8e37"
@@ -25,25 +28,70 @@
 #define CENTRAL_TO_SFIDA_CHARACTERISTIC_UUID    "bbe877095b894433ab7f8b8eef0d8e38"
 #define SFIDA_TO_CENTRAL_CHARACTERISTIC_UUID    "bbe877095b894433ab7f8b8eef0d8e3a"
 
+#define SFIDA_COMMAND_LEN                       4
+#define CENTRAL_TO_SFIDA_MAX_LEN                256
+#define SFIDA_TO_CENTRAL_MAX_LEN                378
+#define SFIDA_TO_CENTRAL_MAX_SEGMENTS           4
+
+// Read authorization replies carry one ATT_MTU - 1 chunk at most, pointing
+// into the value where it lies; a copy is only made for a chunk the value
+// does not hold in one piece
+#ifndef NRF_SDH_BLE_GATT_MAX_MTU_SIZE
+#define NRF_SDH_BLE_GATT_MAX_MTU_SIZE           23
+#endif
+#define READ_REPLY_MAX_LEN                      (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 1)
+
+
+/**
+ * Part of a sfidaToCentral message. The data is only read when the central
+ * reads the characteristic, so it must stay valid until the next send().
+ */
+struct MessageSegment
+{
+    const uint8_t* data;
+    uint16_t len;
+};
+
+
+/**
+ * A complete centralToSfida frame, pointing into the reassembly buffer.
+ * Valid until the next write to centralToSfida.
+ */
+struct FrameView
+{
+    const uint8_t* data;
+    uint16_t len;
+    uint16_t copied;    // bytes copied to reassemble it
+};
+
 
 class CertificateService {
 public:
 
     CertificateService(BLEDevice &ble) :
         _ble(ble),
-        _sfidaCommandsChar(SFIDA_COMMANDS_CHARACTERISTIC_UUID, (uint8_t*)_command, 0, 4, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY),
-        _centralToSfidaChar(CENTRAL_TO_SFIDA_CHARACTERISTIC_UUID, (uint8_t*)_readBuffer, 0, 256, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE),
-        _sfidaToCentralChar(SFIDA_TO_CENTRAL_CHARACTERISTIC_UUID, (uint8_t*)_writeBuffer, 0, 378, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ)
+        _sfidaCommandsChar(SFIDA_COMMANDS_CHARACTERISTIC_UUID, (uint8_t*)_command, 0, SFIDA_COMMAND_LEN, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY),
+        _centralToSfidaChar(CENTRAL_TO_SFIDA_CHARACTERISTIC_UUID, (uint8_t*)_readBuffer, 0, CENTRAL_TO_SFIDA_MAX_LEN, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE),
+        _sfidaToCentralChar(SFIDA_TO_CENTRAL_CHARACTERISTIC_UUID, NULL, 0, SFIDA_TO_CENTRAL_MAX_LEN, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ),
+        _segmentCount(0),
+        _messageLen(0),
+        _frameLen(0),
+        _frameCopied(0),
+        _expectedLen(0),
+        _frameComplete(false)
     {
         _sfidaCommandsChar.setSecurityRequirements(
             GattCharacteristic::SecurityRequirement_t::UNAUTHENTICATED,
             GattCharacteristic::SecurityRequirement_t::UNAUTHENTICATED,
             GattCharacteristic::SecurityRequirement_t::UNAUTHENTICATED);
 
+        // sfidaToCentral is filled chunk by chunk as the central reads it
+        _sfidaToCentralChar.setReadAuthorizationCallback(this, &CertificateService::onSfidaToCentralRead);
+
         GattCharacteristic *charTable[] = {&_sfidaCommandsChar, &_centralToSfidaChar, &_sfidaToCentralChar};
         GattService         certificateService(CERTIFICATE_SERVICE_UUID, charTable, sizeof(charTable) / sizeof(GattCharacteristic *));
         ble_error_t res = _ble.gattServer().addService(certificateService);
-        printf("CertificateService: %d\n", res);
+        PGP_LOG("CertificateService: %d\n", res);
     }
 
     GattAttribute::Handle_t sfidaCommandsHandle() const
@@ -61,57 +109,313 @@ public:
         return _sfidaToCentralChar.getValueHandle();
     }
 
-    void send(uint8_t (&command)[4], uint8_t* data = NULL, uint16_t len = 0)
+    /**
+     * Publish command on sfidaCommands and arm sfidaToCentral with command
+     * followed by data. The data is copied, the caller may reuse it at once.
+     */
+    bool send(uint8_t (&command)[SFIDA_COMMAND_LEN], const uint8_t* data = NULL, uint16_t len = 0)
     {
-        // Copy command to both buffers
-        memcpy((void*)_command, (void*)command, 4);
-        memcpy((void*)_writeBuffer, (void*)command, 4);
+        if (len > sizeof(_payload))
+        {
+            return false;
+        }
 
-        // If there is any data, copy to sfidaToCentral
-        if (data != NULL)
+        if (len > 0)
         {
-            memcpy((void*)((intptr_t)_writeBuffer + 4), (void*)data, (size_t)len);
+            memcpy(_payload, data, len);
         }
 
-        // Write sfidaToCentral
-        ble_error_t res = _ble.gattServer().write(
-            sfidaToCentralHandle(),
-            _writeBuffer,
-            len + 4
-        );
+        MessageSegment segment = { _payload, len };
+        return send(command, &segment, data != NULL ? 1 : 0);
+    }
+
+    /**
+     * Same, but the segments are borrowed, not copied: they must stay valid
+     * until the next send(). Reads are served from them by
+     * onSfidaToCentralRead, one chunk at a time, which saves copying the
+     * whole message into the attribute table on every send. It does not
+     * shrink anything: the attribute keeps its SFIDA_TO_CENTRAL_MAX_LEN
+     * maximum, so gatt_attr_tab_size is the same. A chunk within one
+     * segment is replied in place; one straddling two is put together in
+     * _chunk first.
+     */
+    bool send(uint8_t (&command)[SFIDA_COMMAND_LEN], const MessageSegment* segments, uint8_t count)
+    {
+        PROFILE_SCOPE("CertificateService::send");
+
+        uint32_t len = SFIDA_COMMAND_LEN;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            len += segments[i].len;
+        }
+
+        // Payload must fit after the command in sfidaToCentral
+        if (count >= SFIDA_TO_CENTRAL_MAX_SEGMENTS || len > SFIDA_TO_CENTRAL_MAX_LEN)
+        {
+            return false;
+        }
+
+        memcpy((void*)_command, (void*)command, SFIDA_COMMAND_LEN);
+
+        _segments[0].data = _command;
+        _segments[0].len = SFIDA_COMMAND_LEN;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            _segments[i + 1] = segments[i];
+        }
+        _segmentCount = count + 1;
+        _messageLen = len;
+
+        // Drop the previous value so no stale tail is ever served
+        ble_error_t res = _ble.gattServer().write(sfidaToCentralHandle(), _command, 0, true);
 
-        printf(" >] Write sfidaToCentral: %d\n", res);
+        PGP_LOG(" >] Armed sfidaToCentral: %d bytes (%d)\n", _messageLen, res);
 
         // Write sfidaCommands
         res = _ble.gattServer().write(
             sfidaCommandsHandle(),
             _command,
-            4
+            SFIDA_COMMAND_LEN
         );
 
-        printf(" >] Write sfidaCommands: %d\n", res);
+        PGP_LOG(" >] Write sfidaCommands: %d\n", res);
+
+        if (res != BLE_ERROR_NONE)
+        {
+            Diagnostics::notificationDropped();
+        }
+
+        return res == BLE_ERROR_NONE;
     }
-    
-    uint8_t* read(uint16_t* bytesRead)
+
+    /**
+     * The next frame, if sent as several write commands, is complete once
+     * this many bytes arrived; 0 makes every write command a frame of its
+     * own. Cleared again when that frame completes.
+     */
+    void expectFrame(uint16_t len)
     {
-        _ble.gattServer().read(
-            centralToSfidaHandle(),
-            _readBuffer,
-            bytesRead
-        );
+        _expectedLen = len;
+    }
+
+    /**
+     * Reassemble centralToSfida in place from the write callback data, be it
+     * a plain write, a prepared (long) write or a run of write commands.
+     * A long write the stack queued without handing out its fragments is
+     * read back from the attribute once it executes.
+     * Returns true once a frame is complete, see frame().
+     */
+    bool onDataWritten(const GattWriteCallbackParams *params)
+    {
+        // A new write after a complete frame starts the next one
+        if (_frameComplete)
+        {
+            resetFrame();
+        }
+
+        switch (params->writeOp)
+        {
+            case GattWriteCallbackParams::OP_PREP_WRITE_REQ:
+                store(params->offset, params->data, params->len);
+                break;
+
+            case GattWriteCallbackParams::OP_EXEC_WRITE_REQ_NOW:
+                // No fragments came through: the stack queued them itself
+                // and only the assembled value is left to read
+                if (_frameLen == 0 && params->len == 0)
+                {
+                    _frameComplete = load();
+                    break;
+                }
+
+                _frameComplete = store(params->offset, params->data, params->len) && _frameLen > 0;
+                break;
+
+            case GattWriteCallbackParams::OP_EXEC_WRITE_REQ_CANCEL:
+                resetFrame();
+                break;
+
+            case GattWriteCallbackParams::OP_WRITE_CMD:
+            case GattWriteCallbackParams::OP_SIGN_WRITE_CMD:
+                // Commands carry no offset, fragments simply follow each other
+                _frameComplete = store(_frameLen, params->data, params->len) &&
+                    (_expectedLen == 0 || _frameLen >= _expectedLen);
+                break;
+
+            default:
+                if (params->offset == 0)
+                {
+                    resetFrame();
+                }
+
+                _frameComplete = store(params->offset, params->data, params->len);
+                break;
+        }
+
+        if (_frameComplete)
+        {
+            _expectedLen = 0;
+        }
+
+        return _frameComplete;
+    }
+
+    /** Forget the armed message and any partial or complete frame */
+    void reset()
+    {
+        resetFrame();
+        _expectedLen = 0;
+        _segmentCount = 0;
+        _messageLen = 0;
+    }
 
-        return _readBuffer;
+    FrameView frame() const
+    {
+        FrameView view = { _readBuffer, (uint16_t)(_frameComplete ? _frameLen : 0), _frameCopied };
+        return view;
     }
 
 private:
+    /** Read (blob) of sfidaToCentral: reply just the requested chunk */
+    void onSfidaToCentralRead(GattReadAuthCallbackParams *params)
+    {
+        if (params->offset > _messageLen)
+        {
+            params->authorizationReply = AUTH_CALLBACK_REPLY_ATTERR_INVALID_OFFSET;
+            return;
+        }
+
+        uint16_t len = _messageLen - params->offset;
+        if (len > READ_REPLY_MAX_LEN)
+        {
+            len = READ_REPLY_MAX_LEN;
+        }
+
+        const uint8_t* data = locate(params->offset, len);
+        if (data == NULL)
+        {
+            data = _chunk;
+            len = fill(params->offset, _chunk, len);
+        }
+
+        params->data = (uint8_t*)data;
+        params->len = len;
+        params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+    }
+
+    /** Message bytes [offset, offset + len) in place, NULL unless one segment holds them all */
+    const uint8_t* locate(uint16_t offset, uint16_t len)
+    {
+        uint16_t start = 0;
+        for (uint8_t i = 0; i < _segmentCount; i++)
+        {
+            const MessageSegment& segment = _segments[i];
+            uint16_t end = start + segment.len;
+
+            if (offset < end)
+            {
+                return offset + len <= end ? &segment.data[offset - start] : NULL;
+            }
+
+            start = end;
+        }
+
+        return NULL;
+    }
+
+    /** Copy message bytes [offset, offset + max) straight from the segments */
+    uint16_t fill(uint16_t offset, uint8_t* out, uint16_t max)
+    {
+        uint16_t written = 0;
+        uint16_t start = 0;
+
+        for (uint8_t i = 0; i < _segmentCount && written < max; i++)
+        {
+            const MessageSegment& segment = _segments[i];
+            uint16_t end = start + segment.len;
+
+            if (offset + written < end)
+            {
+                uint16_t from = offset + written - start;
+                uint16_t n = end - (offset + written);
+                if (n > max - written)
+                {
+                    n = max - written;
+                }
+
+                memcpy(&out[written], &segment.data[from], n);
+                written += n;
+            }
+
+            start = end;
+        }
+
+        return written;
+    }
+
+    /** Read the whole centralToSfida value into the frame, counted as copied */
+    bool load()
+    {
+        uint16_t len = sizeof(_readBuffer);
+        if (_ble.gattServer().read(centralToSfidaHandle(), _readBuffer, &len) != BLE_ERROR_NONE || len == 0)
+        {
+            resetFrame();
+            return false;
+        }
+
+        _frameLen = len;
+        _frameCopied += len;
+        return true;
+    }
+
+    void resetFrame()
+    {
+        _frameLen = 0;
+        _frameCopied = 0;
+        _frameComplete = false;
+    }
+
+    /** Copy a fragment to its place in the frame, the only copy made */
+    bool store(uint16_t offset, const uint8_t* data, uint16_t len)
+    {
+        if (offset + len > sizeof(_readBuffer))
+        {
+            resetFrame();
+            return false;
+        }
+
+        if (len > 0)
+        {
+            memcpy(&_readBuffer[offset], data, len);
+            _frameCopied += len;
+        }
+
+        if (offset + len > _frameLen)
+        {
+            _frameLen = offset + len;
+        }
+
+        return true;
+    }
+
     BLEDevice& _ble;
     GattCharacteristic _sfidaCommandsChar;
     GattCharacteristic _centralToSfidaChar;
     GattCharacteristic _sfidaToCentralChar;
 
-    uint8_t _command[4];
-    uint8_t _readBuffer[378];
-    uint8_t _writeBuffer[256];
+    uint8_t _command[SFIDA_COMMAND_LEN];
+    uint8_t _payload[SFIDA_TO_CENTRAL_MAX_LEN - SFIDA_COMMAND_LEN];
+    uint8_t _readBuffer[CENTRAL_TO_SFIDA_MAX_LEN];
+
+    MessageSegment _segments[SFIDA_TO_CENTRAL_MAX_SEGMENTS];
+    uint8_t _segmentCount;
+    uint16_t _messageLen;
+    uint8_t _chunk[READ_REPLY_MAX_LEN];
+
+    uint16_t _frameLen;
+    uint16_t _frameCopied;
+    uint16_t _expectedLen;
+    bool _frameComplete;
 };
 
 #endif /* #ifndef __BLE_LED_SERVICE_H__ */
@@ -18,6 +18,7 @@
 #define __BLE_CONTROL_SERVICE_H__
 
 #include "ble/BLE.h"
+#include "Log.h"
 
 
 #define CONTROL_SERVICE_UUID                "21c5046267cb63a35c4c82b5b9939aeb"
@@ -48,7 +49,7 @@ public:
         GattCharacteristic *charTable[] = {&_ledVibrateChar, &_buttonChar, &_unkChar, &_updateRequestChar, &_versionChar};
         GattService         controlService(CONTROL_SERVICE_UUID, charTable, sizeof(charTable) / sizeof(GattCharacteristic *));
         ble_error_t res = ble.gattServer().addService(controlService);
-        printf("ControlService: %d\n", res);
+        PGP_LOG("ControlService: %d\n", res);
     }
 
     GattAttribute::Handle_t ledVibrateHandle() const
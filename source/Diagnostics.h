@@ -0,0 +1,305 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __DIAGNOSTICS_H__
+#define __DIAGNOSTICS_H__
+
+#include <mbed.h>
+#include "platform/mbed_critical.h"
+#include "platform/mbed_stats.h"
+#include "rtos/Kernel.h"
+#include "StackMonitor.h"
+
+
+#define DIAGNOSTICS_VERSION             4
+#define DIAGNOSTICS_LATENCY_BUCKETS     16
+#define DIAGNOSTICS_MAX_STEPS           8
+#define DIAGNOSTICS_REPORTED_STEPS      5
+
+
+/** What the CPU was woken up (or dispatched) for */
+enum WakeupSource
+{
+    WAKEUP_BLE,
+    WAKEUP_HANDSHAKE,
+    WAKEUP_ALIVENESS,
+    WAKEUP_ENTROPY,
+    WAKEUP_DIAGNOSTICS,
+    WAKEUP_BATTERY,
+    _WAKEUP_SOURCES
+};
+
+
+/**
+ * Counters as exposed by DiagnosticsService. Little endian, no padding.
+ * Latencies are upper bounds of power-of-two millisecond buckets.
+ */
+MBED_PACKED(struct) DiagnosticsSnapshot
+{
+    uint8_t  version;
+    uint32_t uptimeSeconds;
+    uint16_t handshakes;
+    uint16_t failedSteps;
+    uint16_t stepLatencyMs[DIAGNOSTICS_REPORTED_STEPS][3];  // p50, p90, p99
+    uint8_t  bleEventsHighWater;        // BLE events pending at once, eventArenaPeak covers the whole queue
+    uint16_t eventQueueFull;
+    uint16_t notificationDrops;
+    uint32_t reconnectMs;
+    uint32_t heapHighWater;
+    uint32_t stackHighWater;
+    uint32_t wakeups[_WAKEUP_SOURCES];
+    uint32_t sleepMs;                   // needs MBED_CPU_STATS_ENABLED
+    uint32_t awakeMs;
+    uint16_t mainStackPeak;             // needs the "stack-monitor" option
+    uint16_t eventArenaPeak;            // bytes of the event queue arena ever in use
+};
+
+
+/**
+ * Runtime performance counters.
+ *
+ * Every update is a single lock-free atomic operation so it can sit on the
+ * BLE callback and event queue hot paths. snapshot() copies the raw counters
+ * inside a short critical section and derives percentiles afterwards.
+ * With the "diagnostics" app option disabled all updates compile to nothing.
+ */
+class Diagnostics
+{
+public:
+    static uint32_t now()
+    {
+        return (uint32_t)rtos::Kernel::get_ms_count();
+    }
+
+#if MBED_CONF_APP_DIAGNOSTICS
+    static void handshakeCompleted()
+    {
+        core_util_atomic_incr_u16(&_counters.handshakes, 1);
+    }
+
+    static void stepCompleted(uint8_t step, uint32_t latencyMs)
+    {
+        if (step >= DIAGNOSTICS_MAX_STEPS)
+        {
+            return;
+        }
+
+        core_util_atomic_incr_u16(&_counters.stepLatency[step][bucket(latencyMs)], 1);
+    }
+
+    static void stepFailed()
+    {
+        core_util_atomic_incr_u16(&_counters.failedSteps, 1);
+    }
+
+    /** Only the BLE stack's posts are counted, the arena peak covers the rest */
+    static void bleEventQueued()
+    {
+        uint8_t pending = core_util_atomic_incr_u8(&_counters.bleEventsPending, 1);
+        raise(&_counters.bleEventsHighWater, pending);
+    }
+
+    static void bleEventDispatched()
+    {
+        core_util_atomic_decr_u8(&_counters.bleEventsPending, 1);
+    }
+
+    static void eventQueueFull()
+    {
+        core_util_atomic_incr_u16(&_counters.eventQueueFull, 1);
+    }
+
+    static void notificationDropped()
+    {
+        core_util_atomic_incr_u16(&_counters.notificationDrops, 1);
+    }
+
+    static void wakeup(WakeupSource source)
+    {
+        core_util_atomic_incr_u32(&_counters.wakeups[source], 1);
+    }
+
+    static void connected()
+    {
+        uint32_t since = _counters.disconnectedAt;
+        if (since != 0)
+        {
+            _counters.reconnectMs = now() - since;
+        }
+    }
+
+    static void disconnected()
+    {
+        // 0 means "never disconnected"
+        _counters.disconnectedAt = now() | 1;
+    }
+
+    /** Start over, e.g. after a benchmark run drove the handshake */
+    static void reset()
+    {
+        core_util_critical_section_enter();
+        memset((void*)&_counters, 0, sizeof(_counters));
+        core_util_critical_section_exit();
+    }
+
+    static void snapshot(DiagnosticsSnapshot* out, const uint8_t (&steps)[DIAGNOSTICS_REPORTED_STEPS])
+    {
+        Counters copy;
+
+        core_util_critical_section_enter();
+        memcpy((void*)&copy, (const void*)&_counters, sizeof(copy));
+        core_util_critical_section_exit();
+
+        out->version = DIAGNOSTICS_VERSION;
+        out->uptimeSeconds = (uint32_t)(rtos::Kernel::get_ms_count() / 1000);
+        out->handshakes = copy.handshakes;
+        out->failedSteps = copy.failedSteps;
+
+        for (int i = 0; i < DIAGNOSTICS_REPORTED_STEPS; i++)
+        {
+            const uint16_t* histogram = copy.stepLatency[steps[i] % DIAGNOSTICS_MAX_STEPS];
+            out->stepLatencyMs[i][0] = percentile(histogram, 50);
+            out->stepLatencyMs[i][1] = percentile(histogram, 90);
+            out->stepLatencyMs[i][2] = percentile(histogram, 99);
+        }
+
+        out->bleEventsHighWater = copy.bleEventsHighWater;
+        out->eventQueueFull = copy.eventQueueFull;
+        out->notificationDrops = copy.notificationDrops;
+        out->reconnectMs = copy.reconnectMs;
+        out->heapHighWater = 0;
+        out->stackHighWater = 0;
+        out->sleepMs = 0;
+        out->awakeMs = 0;
+        out->mainStackPeak = StackMonitor::stackPeak(0);
+        out->eventArenaPeak = StackMonitor::arenaPeak();
+
+        for (int i = 0; i < _WAKEUP_SOURCES; i++)
+        {
+            out->wakeups[i] = copy.wakeups[i];
+        }
+
+#if defined(MBED_HEAP_STATS_ENABLED)
+        mbed_stats_heap_t heap;
+        mbed_stats_heap_get(&heap);
+        out->heapHighWater = heap.max_size;
+#endif
+
+#if defined(MBED_STACK_STATS_ENABLED)
+        mbed_stats_stack_t stack;
+        mbed_stats_stack_get(&stack);
+        out->stackHighWater = stack.max_size;
+#endif
+
+#if defined(MBED_CPU_STATS_ENABLED)
+        mbed_stats_cpu_t cpu;
+        mbed_stats_cpu_get(&cpu);
+        uint64_t asleep = cpu.sleep_time + cpu.deep_sleep_time;
+        out->sleepMs = (uint32_t)(asleep / 1000);
+        out->awakeMs = (uint32_t)((cpu.uptime - asleep) / 1000);
+#endif
+    }
+
+private:
+    struct Counters
+    {
+        uint16_t handshakes;
+        uint16_t failedSteps;
+        uint16_t stepLatency[DIAGNOSTICS_MAX_STEPS][DIAGNOSTICS_LATENCY_BUCKETS];
+        uint8_t  bleEventsPending;
+        uint8_t  bleEventsHighWater;
+        uint16_t eventQueueFull;
+        uint16_t notificationDrops;
+        uint32_t disconnectedAt;
+        uint32_t reconnectMs;
+        uint32_t wakeups[_WAKEUP_SOURCES];
+    };
+
+    static uint8_t bucket(uint32_t ms)
+    {
+        // Bucket n holds latencies in [2^(n-1), 2^n)
+        uint8_t n = 0;
+        while (ms != 0 && n < DIAGNOSTICS_LATENCY_BUCKETS - 1)
+        {
+            ms >>= 1;
+            n++;
+        }
+
+        return n;
+    }
+
+    static uint16_t percentile(const uint16_t* histogram, uint8_t pct)
+    {
+        uint32_t total = 0;
+        for (int i = 0; i < DIAGNOSTICS_LATENCY_BUCKETS; i++)
+        {
+            total += histogram[i];
+        }
+
+        if (total == 0)
+        {
+            return 0;
+        }
+
+        uint32_t rank = (total * pct + 99) / 100;
+        uint32_t seen = 0;
+        for (int i = 0; i < DIAGNOSTICS_LATENCY_BUCKETS; i++)
+        {
+            seen += histogram[i];
+            if (seen >= rank)
+            {
+                return (uint16_t)((1u << i) - 1);
+            }
+        }
+
+        return 0xFFFF;
+    }
+
+    static void raise(volatile uint8_t* mark, uint8_t value)
+    {
+        uint8_t current = *mark;
+        while (value > current)
+        {
+            if (core_util_atomic_cas_u8(mark, &current, value))
+            {
+                break;
+            }
+        }
+    }
+
+    static volatile Counters _counters;
+#else
+    static void handshakeCompleted() {}
+    static void stepCompleted(uint8_t step, uint32_t latencyMs) {}
+    static void stepFailed() {}
+    static void bleEventQueued() {}
+    static void bleEventDispatched() {}
+    static void eventQueueFull() {}
+    static void notificationDropped() {}
+    static void wakeup(WakeupSource source) {}
+    static void connected() {}
+    static void disconnected() {}
+    static void reset() {}
+
+    static void snapshot(DiagnosticsSnapshot* out, const uint8_t (&steps)[DIAGNOSTICS_REPORTED_STEPS])
+    {
+        memset(out, 0, sizeof(*out));
+        out->version = DIAGNOSTICS_VERSION;
+    }
+#endif
+};
+
+#endif /* #ifndef __DIAGNOSTICS_H__ */
@@ -0,0 +1,186 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BLE_DIAGNOSTICS_SERVICE_H__
+#define __BLE_DIAGNOSTICS_SERVICE_H__
+
+#include <events/mbed_events.h>
+#include "ble/BLE.h"
+#include "CertificateService.h"
+#include "Diagnostics.h"
+#include "Handshake.h"
+#include "Log.h"
+
+
+#define DIAGNOSTICS_SERVICE_UUID                "a3c800015e7b4f5d9c1e2b8a6d4f0e11"
+#define COUNTERS_CHARACTERISTIC_UUID            "a3c800025e7b4f5d9c1e2b8a6d4f0e11"
+
+#define DIAGNOSTICS_STREAM_INTERVAL_MS          1000
+#define DIAGNOSTICS_CHUNK_LEN                   19
+
+
+/**
+ * Vendor service exposing the Diagnostics counters.
+ *
+ * A read snapshots the counters once (at offset 0) and serves every blob of
+ * the long read from that same copy, never from the stored attribute value,
+ * one READ_REPLY_MAX_LEN chunk at a time.
+ * While a central is subscribed it gets its own snapshot streamed as
+ * notifications, each prefixed with its byte offset.
+ */
+class DiagnosticsService {
+public:
+
+    DiagnosticsService(BLEDevice &ble, EventQueue &eventQueue) :
+        _ble(ble),
+        _eventQueue(eventQueue),
+        _streamEvent(0),
+        _countersChar(COUNTERS_CHARACTERISTIC_UUID, (uint8_t*)&_snapshot, 0, sizeof(_snapshot),
+            GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY)
+    {
+        _countersChar.setReadAuthorizationCallback(this, &DiagnosticsService::onCountersRead);
+
+        GattCharacteristic *charTable[] = {&_countersChar};
+        GattService         diagnosticsService(DIAGNOSTICS_SERVICE_UUID, charTable, sizeof(charTable) / sizeof(GattCharacteristic *));
+        ble_error_t res = _ble.gattServer().addService(diagnosticsService);
+        PGP_LOG("DiagnosticsService: %d\n", res);
+        if (res != BLE_ERROR_NONE)
+        {
+            error("DiagnosticsService: cannot add the service (%d), check nordic-ble.gatt_attr_tab_size\r\n", res);
+        }
+
+        _ble.gattServer().onUpdatesDisabled(GattServer::EventCallback_t(this, &DiagnosticsService::onUpdatesDisabled));
+        _ble.gap().onDisconnection(this, &DiagnosticsService::disconnectionCallback);
+    }
+
+    GattAttribute::Handle_t countersHandle() const
+    {
+        return _countersChar.getValueHandle();
+    }
+
+    /**
+     * Start streaming once the central subscribes to the counters. GattServer
+     * only keeps one updates-enabled callback, so main forwards it here.
+     */
+    void onUpdatesEnabled(GattAttribute::Handle_t handle)
+    {
+        if (handle == countersHandle() && _streamEvent == 0)
+        {
+            _streamEvent = _eventQueue.call_every(DIAGNOSTICS_STREAM_INTERVAL_MS, this, &DiagnosticsService::stream);
+        }
+    }
+
+private:
+    void onUpdatesDisabled(GattAttribute::Handle_t handle)
+    {
+        if (handle == countersHandle())
+        {
+            stopStream();
+        }
+    }
+
+    void disconnectionCallback(const Gap::DisconnectionCallbackParams_t *params)
+    {
+        stopStream();
+    }
+
+    void stopStream()
+    {
+        if (_streamEvent != 0)
+        {
+            _eventQueue.cancel(_streamEvent);
+            _streamEvent = 0;
+        }
+    }
+
+    void onCountersRead(GattReadAuthCallbackParams *params)
+    {
+        // Every blob of a long read comes from the copy taken at offset 0
+        if (params->offset == 0)
+        {
+            takeSnapshot(&_snapshot);
+        }
+
+        if (params->offset > sizeof(_snapshot))
+        {
+            params->authorizationReply = AUTH_CALLBACK_REPLY_ATTERR_INVALID_OFFSET;
+            return;
+        }
+
+        uint16_t len = sizeof(_snapshot) - params->offset;
+        if (len > READ_REPLY_MAX_LEN)
+        {
+            len = READ_REPLY_MAX_LEN;
+        }
+
+        params->data = (uint8_t*)&_snapshot + params->offset;
+        params->len = len;
+        params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+    }
+
+    void stream()
+    {
+        Diagnostics::wakeup(WAKEUP_DIAGNOSTICS);
+
+        // A copy of its own, so a long read in progress keeps seeing one snapshot
+        takeSnapshot(&_streamed);
+
+        const uint8_t* snapshot = (const uint8_t*)&_streamed;
+        for (uint16_t offset = 0; offset < sizeof(_streamed); offset += DIAGNOSTICS_CHUNK_LEN)
+        {
+            uint16_t len = sizeof(_streamed) - offset;
+            if (len > DIAGNOSTICS_CHUNK_LEN)
+            {
+                len = DIAGNOSTICS_CHUNK_LEN;
+            }
+
+            _chunk[0] = (uint8_t)offset;
+            memcpy(&_chunk[1], snapshot + offset, len);
+
+            if (_ble.gattServer().write(countersHandle(), _chunk, len + 1) != BLE_ERROR_NONE)
+            {
+                // Out of TX buffers, retry on the next interval
+                Diagnostics::notificationDropped();
+                return;
+            }
+        }
+    }
+
+    static void takeSnapshot(DiagnosticsSnapshot* snapshot)
+    {
+        static const uint8_t steps[DIAGNOSTICS_REPORTED_STEPS] = {
+            Handshake::CONNECTED,
+            Handshake::BOND_DONE,
+            Handshake::SUBSCRIBED_SFIDA_COMMANDS,
+            Handshake::SENT_00_00_00_00,
+            Handshake::RESP_00_00_00_00
+        };
+
+        Diagnostics::snapshot(snapshot, steps);
+    }
+
+private:
+    BLEDevice& _ble;
+    EventQueue& _eventQueue;
+    int _streamEvent;
+    GattCharacteristic _countersChar;
+
+    DiagnosticsSnapshot _snapshot;
+    DiagnosticsSnapshot _streamed;
+    uint8_t _chunk[DIAGNOSTICS_CHUNK_LEN + 1];
+};
+
+#endif /* #ifndef __BLE_DIAGNOSTICS_SERVICE_H__ */
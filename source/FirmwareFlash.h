@@ -0,0 +1,191 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __FIRMWARE_FLASH_H__
+#define __FIRMWARE_FLASH_H__
+
+#include <mbed.h>
+
+
+#if DEVICE_FLASH
+
+#if defined(TOOLCHAIN_GCC_ARM)
+extern "C" uint32_t __etext;
+extern "C" uint32_t __data_start__;
+extern "C" uint32_t __data_end__;
+#elif defined(TOOLCHAIN_ARM)
+extern "C" uint32_t Load$$LR$$LR_IROM1$$Limit;
+#endif
+
+/** Internal flash, through FlashIAP */
+class FirmwareFlash
+{
+public:
+    int init()
+    {
+        return _flash.init();
+    }
+
+    uint32_t sectorSize(uint32_t address)
+    {
+        return _flash.get_sector_size(address);
+    }
+
+    int erase(uint32_t address, uint32_t size)
+    {
+        return _flash.erase(address, size);
+    }
+
+    int program(const void* buffer, uint32_t address, uint32_t size)
+    {
+        return _flash.program(buffer, address, size);
+    }
+
+    int read(void* buffer, uint32_t address, uint32_t size)
+    {
+        return _flash.read(buffer, address, size);
+    }
+
+    /** First address past the running image (code, then the .data load image) */
+    uint32_t imageEnd()
+    {
+#if defined(TOOLCHAIN_GCC_ARM)
+        return (uint32_t)&__etext + ((uint32_t)&__data_end__ - (uint32_t)&__data_start__);
+#elif defined(TOOLCHAIN_ARM)
+        return (uint32_t)&Load$$LR$$LR_IROM1$$Limit;
+#else
+        // Unknown layout: assume the image may reach the end of flash
+        return _flash.get_flash_start() + _flash.get_flash_size();
+#endif
+    }
+
+private:
+    FlashIAP _flash;
+};
+
+#elif defined(FIRMWARE_FLASH_SIMULATED)
+
+#define SIMULATED_FLASH_SECTOR_SIZE         4096
+#define SIMULATED_FLASH_ERASE_US            85000   // nRF52 page erase
+#define SIMULATED_FLASH_PROGRAM_WORD_US     41      // nRF52 word write
+
+/**
+ * RAM backed stand-in for the host build (fuzz/firmware_host.cpp),
+ * blocking for as long as the nRF52 NVMC would so the erase/program
+ * overlap can be observed. The whole bank lives on the heap, so the host
+ * build uses a small one.
+ */
+class FirmwareFlash
+{
+public:
+    FirmwareFlash() :
+        _memory(NULL)
+    {
+    }
+
+    ~FirmwareFlash()
+    {
+        delete[] _memory;
+    }
+
+    int init()
+    {
+        if (_memory == NULL)
+        {
+            _memory = new uint8_t[MBED_CONF_APP_FIRMWARE_BANK_SIZE];
+            memset(_memory, 0xFF, MBED_CONF_APP_FIRMWARE_BANK_SIZE);
+        }
+
+        return 0;
+    }
+
+    uint32_t sectorSize(uint32_t address)
+    {
+        return SIMULATED_FLASH_SECTOR_SIZE;
+    }
+
+    int erase(uint32_t address, uint32_t size)
+    {
+        uint8_t* target = map(address, size);
+        if (target == NULL || size % SIMULATED_FLASH_SECTOR_SIZE)
+        {
+            return -1;
+        }
+
+        wait_us(SIMULATED_FLASH_ERASE_US * (size / SIMULATED_FLASH_SECTOR_SIZE));
+        memset(target, 0xFF, size);
+        return 0;
+    }
+
+    int program(const void* buffer, uint32_t address, uint32_t size)
+    {
+        uint8_t* target = map(address, size);
+        if (target == NULL || size % 4)
+        {
+            return -1;
+        }
+
+        wait_us(SIMULATED_FLASH_PROGRAM_WORD_US * (size / 4));
+
+        // Programming can only clear bits
+        const uint8_t* source = (const uint8_t*)buffer;
+        for (uint32_t i = 0; i < size; i++)
+        {
+            target[i] &= source[i];
+        }
+
+        return 0;
+    }
+
+    int read(void* buffer, uint32_t address, uint32_t size)
+    {
+        uint8_t* source = map(address, size);
+        if (source == NULL)
+        {
+            return -1;
+        }
+
+        memcpy(buffer, source, size);
+        return 0;
+    }
+
+    /** The bank lives in RAM here, it cannot overlap the image */
+    uint32_t imageEnd()
+    {
+        return 0;
+    }
+
+private:
+    uint8_t* map(uint32_t address, uint32_t size)
+    {
+        if (_memory == NULL ||
+            address < MBED_CONF_APP_FIRMWARE_BANK_ADDRESS ||
+            address + size > MBED_CONF_APP_FIRMWARE_BANK_ADDRESS + MBED_CONF_APP_FIRMWARE_BANK_SIZE)
+        {
+            return NULL;
+        }
+
+        return &_memory[address - MBED_CONF_APP_FIRMWARE_BANK_ADDRESS];
+    }
+
+    uint8_t* _memory;
+};
+
+#elif MBED_CONF_APP_FIRMWARE_UPDATE
+#error "The firmware-update option needs internal flash (DEVICE_FLASH)"
+#endif
+
+#endif /* #ifndef __FIRMWARE_FLASH_H__ */
@@ -17,34 +17,527 @@
 #ifndef __BLE_FIRMWARE_SERVICE_H__
 #define __BLE_FIRMWARE_SERVICE_H__
 
+#include <events/mbed_events.h>
+#include <mbed.h>
+#include "drivers/MbedCRC.h"
 #include "ble/BLE.h"
+#include "FirmwareFlash.h"
+#include "Log.h"
+#include "StackMonitor.h"
 
 
-#define FIRMWARE_SERVICE_UUID              "0000fef5000010008000-00805f9b34fb"
-#define UPDATE_REQUEST_CHARACTERISTIC_UUID "21c5046267cb63a35c4c82b5b9939aef"
-#define VERSION_CHARACTERISTIC_UUID        "21c5046267cb63a35c4c82b5b9939af0"
+#define FIRMWARE_SERVICE_UUID               "0000fef500001000800000805f9b34fb"
+#define UPDATE_REQUEST_CHARACTERISTIC_UUID  "21c5046267cb63a35c4c82b5b9939aef"
+#define VERSION_CHARACTERISTIC_UUID         "21c5046267cb63a35c4c82b5b9939af0"
+#define FIRMWARE_DATA_CHARACTERISTIC_UUID   "a3c800035e7b4f5d9c1e2b8a6d4f0e11"
+#define FIRMWARE_STATUS_CHARACTERISTIC_UUID "a3c800045e7b4f5d9c1e2b8a6d4f0e11"
 
+#define FIRMWARE_VERSION                    1
+#define FIRMWARE_PACKET_MAX_LEN             20
+#define FIRMWARE_STAGING_SIZE               1024
+#define FIRMWARE_WRITER_STACK_SIZE          1024        // usable, the stack monitor's guard comes on top
+#define FIRMWARE_BOOT_MAGIC                 0x55504750  // "PGPU"
+#define FIRMWARE_VERIFY_FAILED              -2
 
+
+#if MBED_CONF_APP_FIRMWARE_UPDATE
+
+
+/** Written to updateRequest: op, then for START the image size and CRC32 */
+MBED_PACKED(struct) FirmwareRequest
+{
+    uint8_t  op;
+    uint32_t size;
+    uint32_t crc;
+};
+
+/** Notified on firmwareStatus, at least once per staging buffer programmed */
+MBED_PACKED(struct) FirmwareStatus
+{
+    uint8_t  state;
+    uint32_t received;
+    uint32_t bytesPerSecond;
+    uint16_t credit;        // bytes the central may send beyond received
+};
+
+/**
+ * Left at the start of the last sector of the bank once an image is in
+ * the bank and verified, little endian:
+ *   magic     FIRMWARE_BOOT_MAGIC
+ *   size      image bytes, from the start of the bank
+ *   crc       CRC-32 (ANSI, as MbedCRC POLY_32BIT_ANSI) of those bytes
+ *   reserved  0xFFFFFFFF
+ * Installing it is the bootloader's job: check the CRC, copy the bank
+ * over the application, erase the record, then boot. No bootloader is
+ * part of this tree, so the service stops at STATE_STAGED and does not
+ * reset; an image left staged does nothing until one is flashed.
+ */
+struct FirmwareBootRecord
+{
+    uint32_t magic;
+    uint32_t size;
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+
+/**
+ * Firmware update over BLE.
+ *
+ * The image is streamed as write-without-response packets on firmwareData
+ * into one of two staging buffers. Once a buffer is full it is handed to a
+ * writer thread that erases and programs the bank while the other buffer
+ * keeps receiving, so flash latency overlaps radio time. A sector erase
+ * takes far longer than a buffer takes to arrive, so the central paces
+ * itself: it never has more than the last status' credit in flight, and
+ * a packet beyond it ends the transfer with STATE_ERROR_OVERRUN. The CRC is updated
+ * per packet, and the image is read back from the bank and checked again
+ * before it is committed through a boot record.
+ *
+ * Every characteristic but version needs an encrypted link. Images are
+ * only CRC checked, not signed, so the service is off unless the
+ * firmware-update option is set.
+ */
 class FirmwareService {
+    friend class FirmwareHostTest;
+
 public:
+    enum Request
+    {
+        REQUEST_START = 1,
+        REQUEST_ABORT = 2
+    };
 
-    FirmwareService(BLEDevice &ble) :
+    enum State
+    {
+        STATE_IDLE,
+        STATE_RECEIVING,
+        STATE_COMMITTING,
+        STATE_STAGED,
+        STATE_ERROR_SIZE,
+        STATE_ERROR_OVERRUN,
+        STATE_ERROR_FLASH,
+        STATE_ERROR_CRC,
+        STATE_ERROR_BANK,
+        STATE_ERROR_BUSY
+    };
+
+    FirmwareService(BLEDevice &ble, EventQueue &eventQueue) :
         _ble(ble),
-        _updateRequestChar(UPDATE_REQUEST_CHARACTERISTIC_UUID, &_request, 1, 1, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ),
-        _versionChar(VERSION_CHARACTERISTIC_UUID, &_version, 1, 1,  GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ)
+        _eventQueue(eventQueue),
+        _updateRequestChar(UPDATE_REQUEST_CHARACTERISTIC_UUID, (uint8_t*)&_request, 0, sizeof(_request), GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ),
+        _versionChar(VERSION_CHARACTERISTIC_UUID, &_version, 1, 1, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ),
+        _dataChar(FIRMWARE_DATA_CHARACTERISTIC_UUID, _packet, 0, FIRMWARE_PACKET_MAX_LEN, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE),
+        _statusChar(FIRMWARE_STATUS_CHARACTERISTIC_UUID, (uint8_t*)&_status, sizeof(_status), sizeof(_status), GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY),
+        _writerThread(osPriorityBelowNormal, FIRMWARE_WRITER_STACK_SIZE + STACK_GUARD_OVERHEAD),
+        _writerQueue(4 * EVENTS_EVENT_SIZE),
+        _version(FIRMWARE_VERSION),
+        _state(STATE_IDLE),
+        _received(0),
+        _outstanding(0)
     {
-        GattCharacteristic *charTable[] = {&_updateRequestChar, &_versionChar};
+        memset(&_status, 0, sizeof(_status));
+        _busy[0] = _busy[1] = false;
+
+        GattCharacteristic *secureChars[] = {&_updateRequestChar, &_dataChar, &_statusChar};
+        for (unsigned i = 0; i < sizeof(secureChars) / sizeof(GattCharacteristic *); i++)
+        {
+            secureChars[i]->setSecurityRequirements(
+                GattCharacteristic::SecurityRequirement_t::UNAUTHENTICATED,
+                GattCharacteristic::SecurityRequirement_t::UNAUTHENTICATED,
+                GattCharacteristic::SecurityRequirement_t::UNAUTHENTICATED);
+        }
+
+        GattCharacteristic *charTable[] = {&_updateRequestChar, &_versionChar, &_dataChar, &_statusChar};
         GattService         firmwareService(FIRMWARE_SERVICE_UUID, charTable, sizeof(charTable) / sizeof(GattCharacteristic *));
-        printf("FirmwareService: %d\n", ble.gattServer().addService(firmwareService));
+        ble_error_t res = ble.gattServer().addService(firmwareService);
+        PGP_LOG("FirmwareService: %d\n", res);
+        if (res != BLE_ERROR_NONE)
+        {
+            error("FirmwareService: cannot add the service (%d), check nordic-ble.gatt_attr_tab_size\r\n", res);
+        }
+
+        _flash.init();
+        _writerThread.start(callback(&_writerQueue, &EventQueue::dispatch_forever));
+        StackMonitor::watch(_writerThread.get_id(), "firmware");
+
+        _ble.gattServer().onDataWritten(this, &FirmwareService::onDataWritten);
+    }
+
+    GattAttribute::Handle_t updateRequestHandle() const
+    {
+        return _updateRequestChar.getValueHandle();
+    }
+
+    GattAttribute::Handle_t versionHandle() const
+    {
+        return _versionChar.getValueHandle();
+    }
+
+    GattAttribute::Handle_t dataHandle() const
+    {
+        return _dataChar.getValueHandle();
+    }
+
+    GattAttribute::Handle_t statusHandle() const
+    {
+        return _statusChar.getValueHandle();
+    }
+
+private:
+    void onDataWritten(const GattWriteCallbackParams *params)
+    {
+        if (params->handle == updateRequestHandle())
+        {
+            onRequest(params->data, params->len);
+        }
+        else if (params->handle == dataHandle() && _state == STATE_RECEIVING)
+        {
+            onPacket(params->data, params->len);
+        }
+    }
+
+    void onRequest(const uint8_t* data, uint16_t len)
+    {
+        FirmwareRequest request;
+        memset(&request, 0, sizeof(request));
+        memcpy(&request, data, len < sizeof(request) ? len : sizeof(request));
+
+        if (request.op == REQUEST_ABORT)
+        {
+            // Too late to stop the record: take it back
+            if (_state == STATE_STAGED)
+            {
+                revokeBootRecord();
+            }
+
+            setState(STATE_IDLE);
+            return;
+        }
+
+        if (request.op != REQUEST_START || _state == STATE_RECEIVING || _state == STATE_COMMITTING)
+        {
+            return;
+        }
+
+        // Writes of an aborted session still own the staging buffers
+        if (_outstanding > 0)
+        {
+            setState(STATE_ERROR_BUSY);
+            return;
+        }
+
+        // Erasing the bank would erase the code doing it
+        if (MBED_CONF_APP_FIRMWARE_BANK_ADDRESS < _flash.imageEnd())
+        {
+            PGP_LOG("Firmware: bank 0x%lx overlaps the image ending at 0x%lx\n",
+                (unsigned long)MBED_CONF_APP_FIRMWARE_BANK_ADDRESS, (unsigned long)_flash.imageEnd());
+            setState(STATE_ERROR_BANK);
+            return;
+        }
+
+        _size = request.size;
+        _expectedCrc = request.crc;
+        if (_size == 0 || _size > imageCapacity())
+        {
+            setState(STATE_ERROR_SIZE);
+            return;
+        }
+
+        _received = 0;
+        _programmed = 0;
+        _address = MBED_CONF_APP_FIRMWARE_BANK_ADDRESS;
+        _active = 0;
+        _fill = 0;
+        _crc.compute_partial_start(&_crcValue);
+
+        _timer.reset();
+        _timer.start();
+        setState(STATE_RECEIVING);
+    }
+
+    void onPacket(const uint8_t* data, uint16_t len)
+    {
+        if (_received + len > _size)
+        {
+            setState(STATE_ERROR_SIZE);
+            return;
+        }
+
+        _crc.compute_partial((void*)data, len, &_crcValue);
+        _received += len;
+
+        while (len > 0)
+        {
+            // The writer still owns this buffer: the central is outrunning the flash
+            if (_fill == 0 && _busy[_active])
+            {
+                setState(STATE_ERROR_OVERRUN);
+                return;
+            }
+
+            uint16_t chunk = FIRMWARE_STAGING_SIZE - _fill;
+            if (chunk > len)
+            {
+                chunk = len;
+            }
+
+            memcpy(&_staging[_active][_fill], data, chunk);
+            _fill += chunk;
+            data += chunk;
+            len -= chunk;
+
+            if (_fill == FIRMWARE_STAGING_SIZE || _received == _size)
+            {
+                flush();
+            }
+        }
+    }
+
+    void flush()
+    {
+        // Pad the tail to whole words
+        uint16_t len = (_fill + 3) & ~3;
+        memset(&_staging[_active][_fill], 0xFF, len - _fill);
+
+        _busy[_active] = true;
+        _outstanding++;
+        _writerQueue.call(this, &FirmwareService::program, _active, _address, len);
+
+        _address += len;
+        _active ^= 1;
+        _fill = 0;
+    }
+
+    /** Writer thread: erase sectors as they are entered, then program */
+    void program(uint8_t index, uint32_t address, uint16_t len)
+    {
+        int res = 0;
+        if (address % _flash.sectorSize(address) == 0)
+        {
+            res = _flash.erase(address, _flash.sectorSize(address));
+        }
+
+        if (res == 0)
+        {
+            res = _flash.program(_staging[index], address, len);
+        }
+
+        _busy[index] = false;
+        StackMonitor::check();
+        _eventQueue.call(this, &FirmwareService::onProgrammed, res, len);
+    }
+
+    void onProgrammed(int res, uint16_t len)
+    {
+        _outstanding--;
+        if (_state != STATE_RECEIVING)
+        {
+            return;
+        }
+
+        if (res != 0)
+        {
+            setState(STATE_ERROR_FLASH);
+            return;
+        }
+
+        // Wait until every flushed buffer is in flash
+        _programmed += len;
+        if (_received < _size || _programmed < _address - MBED_CONF_APP_FIRMWARE_BANK_ADDRESS)
+        {
+            notifyStatus();
+            return;
+        }
+
+        _crc.compute_partial_stop(&_crcValue);
+        if (_crcValue != _expectedCrc)
+        {
+            setState(STATE_ERROR_CRC);
+            return;
+        }
+
+        setState(STATE_COMMITTING);
+        _outstanding++;
+        _writerQueue.call(this, &FirmwareService::commit);
+    }
+
+    /** Writer thread: check what the bank holds, then hand it over to the bootloader */
+    void commit()
+    {
+        int res = verify();
+        if (res == 0)
+        {
+            uint32_t address = bootRecordAddress();
+            FirmwareBootRecord record = { FIRMWARE_BOOT_MAGIC, _size, _expectedCrc, 0xFFFFFFFF };
+
+            res = _flash.erase(address, _flash.sectorSize(address));
+            if (res == 0)
+            {
+                res = _flash.program(&record, address, sizeof(record));
+            }
+        }
+
+        StackMonitor::check();
+        _eventQueue.call(this, &FirmwareService::onCommitted, res);
+    }
+
+    /** Writer thread: CRC of the bank as read back, the staging buffers are all idle by now */
+    int verify()
+    {
+        MbedCRC<POLY_32BIT_ANSI, 32> crc;
+        uint32_t value;
+        crc.compute_partial_start(&value);
+
+        for (uint32_t offset = 0; offset < _size; offset += FIRMWARE_STAGING_SIZE)
+        {
+            uint32_t len = _size - offset < FIRMWARE_STAGING_SIZE ? _size - offset : FIRMWARE_STAGING_SIZE;
+            if (_flash.read(_staging[0], MBED_CONF_APP_FIRMWARE_BANK_ADDRESS + offset, len) != 0)
+            {
+                return -1;
+            }
+
+            crc.compute_partial(_staging[0], len, &value);
+        }
+
+        crc.compute_partial_stop(&value);
+        return value == _expectedCrc ? 0 : FIRMWARE_VERIFY_FAILED;
+    }
+
+    void onCommitted(int res)
+    {
+        _outstanding--;
+
+        // Aborted while the writer was busy with it
+        if (_state != STATE_COMMITTING)
+        {
+            if (res == 0)
+            {
+                revokeBootRecord();
+            }
+
+            return;
+        }
+
+        if (res != 0)
+        {
+            setState(res == FIRMWARE_VERIFY_FAILED ? STATE_ERROR_CRC : STATE_ERROR_FLASH);
+            return;
+        }
+
+        _timer.stop();
+        setState(STATE_STAGED);
+        PGP_LOG("Firmware: %lu bytes staged in %d ms (%lu B/s)\n", (unsigned long)_size, _timer.read_ms(), (unsigned long)_status.bytesPerSecond);
+    }
+
+    void revokeBootRecord()
+    {
+        _outstanding++;
+        _writerQueue.call(this, &FirmwareService::revoke);
+    }
+
+    /** Writer thread: erase the boot record so the bootloader leaves the bank alone */
+    void revoke()
+    {
+        uint32_t address = bootRecordAddress();
+        int res = _flash.erase(address, _flash.sectorSize(address));
+        _eventQueue.call(this, &FirmwareService::onRevoked, res);
+    }
+
+    void onRevoked(int res)
+    {
+        _outstanding--;
+        if (res != 0)
+        {
+            setState(STATE_ERROR_FLASH);
+        }
+    }
+
+    void setState(State state)
+    {
+        _state = state;
+        if (state != STATE_RECEIVING && state != STATE_COMMITTING)
+        {
+            _timer.stop();
+        }
+
+        notifyStatus();
+    }
+
+    void notifyStatus()
+    {
+        uint32_t ms = _timer.read_ms();
+
+        _status.state = _state;
+        _status.received = _received;
+        _status.bytesPerSecond = ms ? (uint32_t)(((uint64_t)_received * 1000) / ms) : 0;
+        _status.credit = credit();
+
+        _ble.gattServer().write(statusHandle(), (uint8_t*)&_status, sizeof(_status));
+    }
+
+    /**
+     * Bytes that can still arrive without overrunning: a new packet is only
+     * refused once both buffers are flushed and waiting for the writer.
+     */
+    uint16_t credit()
+    {
+        uint32_t window = _programmed + 2 * FIRMWARE_STAGING_SIZE;
+        if (_state != STATE_RECEIVING || _received >= window)
+        {
+            return 0;
+        }
+
+        return (uint16_t)(window - _received);
+    }
+
+    uint32_t bootRecordAddress()
+    {
+        uint32_t end = MBED_CONF_APP_FIRMWARE_BANK_ADDRESS + MBED_CONF_APP_FIRMWARE_BANK_SIZE;
+        return end - _flash.sectorSize(end - 1);
+    }
+
+    uint32_t imageCapacity()
+    {
+        return bootRecordAddress() - MBED_CONF_APP_FIRMWARE_BANK_ADDRESS;
     }
 
 private:
     BLEDevice& _ble;
+    EventQueue& _eventQueue;
     GattCharacteristic _updateRequestChar;
     GattCharacteristic _versionChar;
+    GattCharacteristic _dataChar;
+    GattCharacteristic _statusChar;
 
-    uint8_t _request;
+    FirmwareFlash _flash;
+    Thread _writerThread;
+    EventQueue _writerQueue;
+    MbedCRC<POLY_32BIT_ANSI, 32> _crc;
+    Timer _timer;
+
+    FirmwareRequest _request;
     uint8_t _version;
+    uint8_t _packet[FIRMWARE_PACKET_MAX_LEN];
+    FirmwareStatus _status;
+
+    State _state;
+    uint32_t _size;
+    uint32_t _expectedCrc;
+    uint32_t _crcValue;
+    uint32_t _received;
+    uint32_t _programmed;
+    uint32_t _address;
+
+    uint8_t _staging[2][FIRMWARE_STAGING_SIZE];
+    volatile bool _busy[2];
+    uint8_t _active;
+    uint16_t _fill;
+
+    /** Writer queue calls not yet answered on the event queue */
+    uint8_t _outstanding;
 };
 
+#endif
+
 #endif /* #ifndef __BLE_LED_SERVICE_H__ */
@@ -17,12 +17,30 @@
 #ifndef __HANDSHAKE_H__
 #define __HANDSHAKE_H__
 
+#include <events/mbed_events.h>
 #include "ble/BLE.h"
 #include "CertificateService.h"
+#include "Diagnostics.h"
+#include "Log.h"
+#include "NoncePool.h"
+#include "Profiler.h"
+
+
+#define HANDSHAKE_RETRY_MS          500
+#define HANDSHAKE_RETRY_MAX_MS      8000
+#define PAIRING_RESPONSE_LEN        20
+
+
+// "device data" sent after the nonce and MAC in the pairing request
+const static uint8_t SFIDA_DEVICE_DATA[] = {
+    0x8c, 0x10, 0x78, 0x8b, 0xfd, 0xcc, 0xb8, 0x94, 0x91, 0xec, 0x06, 0x85, 0xac, 0x8f, 0xee, 0x50, 0xfd, 0xcf, 0xf3, 0x14, 0x63, 0x58, 0xb2, 0x9e, 0x91, 0xed, 0x7e, 0x17, 0xf9, 0x61, 0xdb, 0x26, 0x47, 0x5f, 0xdb, 0x11, 0xea, 0xf8, 0xcc, 0xf0, 0xe3, 0x2b, 0x45, 0x82, 0x8c, 0x29, 0xf6, 0xac, 0xc2, 0x7d, 0x3a, 0x50, 0x6c, 0x69, 0xc6, 0xb1, 0x6a, 0x72, 0x99, 0xc6, 0x8d, 0x5f, 0x68, 0x04, 0x8d, 0xb9, 0x73, 0x5b, 0xc3, 0x83, 0x95, 0x42, 0x76, 0x31, 0x7b, 0x13, 0x38, 0xc9, 0x09, 0x65, 0x3d, 0x5a, 0x86, 0xa3, 0x34, 0x35, 0xf0, 0x51, 0xf6, 0x97, 0xac, 0x11, 0xf5, 0x04, 0xcb, 0x43, 0x50, 0x34, 0x1e, 0x91, 0x4a, 0x70, 0xc6, 0xef, 0xa9, 0x8d, 0xa9, 0x08, 0x46, 0xc5, 0x39, 0x1b, 0xad, 0xad, 0x82, 0xff, 0x5d, 0x10, 0xbd, 0x4c, 0x2f, 0x9d, 0xfe, 0x5c, 0x04, 0x56, 0x3e, 0x88, 0x3a, 0xf4, 0x30, 0xac, 0xf5, 0x58, 0xf8, 0x29, 0x2a, 0x48, 0x74, 0x14, 0x1b, 0xd8, 0xad, 0x64, 0x75, 0x8c, 0x26, 0x26, 0xc5, 0x9c, 0x7c, 0x49, 0x33, 0x4f, 0x15, 0xa2, 0x1b, 0x89, 0x90, 0x03, 0x7f, 0xc2, 0x5f, 0xe5, 0x97, 0xc9, 0x55, 0x2d, 0x25, 0xef, 0x4b, 0x67, 0x85, 0x99, 0x9d, 0xc1, 0xfb, 0x27, 0x20, 0xdb, 0x97, 0x7d, 0x1c, 0xfe, 0x58, 0x5a, 0x6a, 0xd3, 0x9d, 0x2e, 0x1f, 0x18, 0x68, 0xd8, 0x6e, 0xa5, 0xe0, 0x0e, 0x47, 0x1f, 0xe5, 0x29, 0x94, 0xad, 0x97, 0x35, 0xb6, 0xac, 0xa4, 0x17, 0x17, 0x56, 0x04, 0xa8, 0x74, 0x78, 0x61, 0x42, 0x15, 0xb9, 0x07, 0x4b, 0x76, 0x3a, 0x16, 0x0b, 0x11, 0x84, 0xd9, 0x74, 0xfc, 0x4b, 0xc9, 0x49, 0x95, 0x84, 0xca, 0x3e, 0x46, 0xc6, 0xda, 0xee, 0x8b, 0xbe, 0xa1, 0x3a, 0xcd, 0xd7, 0xc0, 0x7a, 0x42, 0x58, 0x27, 0x4a, 0xd6, 0x0a
+};
 
 
 class Handshake
 {
+    friend class Benchmark;
+
 public:
     enum HandshakeStep
     {
@@ -41,11 +59,11 @@ public:
     };
 
 public:
-    static void Init(BLEDevice& ble, CertificateService* certificateService)
+    static void Init(BLEDevice& ble, EventQueue& eventQueue, CertificateService* certificateService, NoncePool* noncePool)
     {
         if (_instance == NULL)
         {
-            _instance = new Handshake(ble, certificateService);
+            _instance = new Handshake(ble, eventQueue, certificateService, noncePool);
         }
     }
 
@@ -54,57 +72,193 @@ public:
         return _instance;
     }
 
+    /**
+     * Called with the milliseconds from connection to RESP_00_00_00_00
+     * every time a handshake completes.
+     */
+    void onCompleted(Callback<void(uint32_t)> callback)
+    {
+        _completedCallback = callback;
+    }
+
+    /**
+     * Updates-enabled callback. GattServer only keeps one, so whoever
+     * registers it (main) forwards every subscription here.
+     */
+    static void onSubscribed(const GattAttribute::Handle_t handle)
+    {
+        if (handle != Handshake::Instance()->_certificateService->sfidaCommandsHandle())
+        {
+            return;
+        }
+
+        Handshake::Instance()->changeState(SUBSCRIBED_SFIDA_COMMANDS);
+    }
+
+    HandshakeStep step() const
+    {
+        return _step;
+    }
+
+    /**
+     * Drop any progress and go back to NONE without touching the BLE stack,
+     * including the pending update and CertificateService's frame state.
+     * The instance is kept, so repeated resets never allocate.
+     */
+    void reset()
+    {
+        if (_updateEvent != 0)
+        {
+            _eventQueue.cancel(_updateEvent);
+            _updateEvent = 0;
+        }
+
+        _step = NONE;
+        _pendingState = NONE;
+        _stepChangedAt = 0;
+        _connectedAt = 0;
+        _retries = 0;
+
+        _certificateService->reset();
+    }
+
     bool update()
     {
+        PROFILE_SCOPE("Handshake::update");
+
         if (_step == _pendingState) 
         {
             return false;
         }
 
         // Select the appropiate function
-        bool (Handshake::*stateFnc)();
-        switch (_pendingState)
+        StepFunction stateFnc = stepFunction(_pendingState);
+        if (stateFnc == NULL)
+        {
+            // Should never happen
+            return false;
+        }
+
+        HandshakeStep reached = _pendingState;
+        if ((this->*stateFnc)())
+        {
+            PGP_LOG(" >] State change %d -> %d\n", _step, _pendingState);
+            _step = _pendingState;
+
+            uint32_t now = Diagnostics::now();
+            Diagnostics::stepCompleted(reached, now - _stepChangedAt);
+            if (_step != reached)
+            {
+                // The step function went straight on to the next one (e.g. sent the request)
+                Diagnostics::stepCompleted(_step, 0);
+            }
+            _stepChangedAt = now;
+
+            if (_step == RESP_00_00_00_00)
+            {
+                Diagnostics::handshakeCompleted();
+
+                if (_completedCallback)
+                {
+                    _completedCallback(now - _connectedAt);
+                }
+            }
+
+            return true;
+        }
+
+        PGP_LOG(" X] Failed State change %d -> %d\n", _step, _pendingState);
+        Diagnostics::stepFailed();
+
+        return false;
+    }
+
+private:
+    typedef bool (Handshake::*StepFunction)();
+
+    /** What reaching step takes, NULL for steps only ever reached as a side effect */
+    static StepFunction stepFunction(HandshakeStep step)
+    {
+        switch (step)
         {
             case NONE:
-                stateFnc = &Handshake::onReset;
-                break;
+                return &Handshake::onReset;
 
             case CONNECTED:
-                stateFnc = &Handshake::onConnect;
-                break;
+                return &Handshake::onConnect;
 
             case BOND_DONE:
-                stateFnc = &Handshake::onBondDone;
-                break;
+                return &Handshake::onBondDone;
 
             case SUBSCRIBED_SFIDA_COMMANDS:
-                stateFnc = &Handshake::onSfidaSubscribed;
-                break;
+                return &Handshake::onSfidaSubscribed;
 
             case RESP_00_00_00_00:
-                stateFnc = &Handshake::onPairingResponse;
-                break;
+                return &Handshake::onPairingResponse;
 
-            // Should never happen
             default:
-                return false;
+                return NULL;
         }
+    }
 
-        if ((this->*stateFnc)())
+    /**
+     * Run update() from the event queue. Nothing is scheduled while no step
+     * is pending, so an idle device is never woken up by the handshake.
+     */
+    void scheduleUpdate(int delayMs = 0)
+    {
+        if (_updateEvent == 0)
         {
-            printf(" >] State change %d -> %d\n", _step, _pendingState);
-            _step = _pendingState;
-            return true;
+            _updateEvent = _eventQueue.call_in(delayMs, this, &Handshake::runUpdate);
         }
+    }
 
-        printf(" X] Failed State change %d -> %d\n", _step, _pendingState);
+    /** A new event outranks a pending retry: run it now, with a fresh backoff */
+    void rescheduleUpdate()
+    {
+        if (_updateEvent != 0)
+        {
+            _eventQueue.cancel(_updateEvent);
+            _updateEvent = 0;
+        }
 
-        return false;
+        _retries = 0;
+        scheduleUpdate();
+    }
+
+    void runUpdate()
+    {
+        _updateEvent = 0;
+        Diagnostics::wakeup(WAKEUP_HANDSHAKE);
+
+        if (update())
+        {
+            _retries = 0;
+            return;
+        }
+
+        // The event that asked for this step will not come again, so a failed
+        // step is retried, backing off up to HANDSHAKE_RETRY_MAX_MS, until it
+        // succeeds or a new event (e.g. a disconnection) replaces it
+        if (_step != _pendingState && stepFunction(_pendingState) != NULL)
+        {
+            uint32_t delayMs = (uint32_t)HANDSHAKE_RETRY_MS << _retries;
+            if (delayMs < HANDSHAKE_RETRY_MAX_MS)
+            {
+                _retries++;
+            }
+            else
+            {
+                delayMs = HANDSHAKE_RETRY_MAX_MS;
+            }
+
+            scheduleUpdate(delayMs);
+        }
     }
 
-private:
     void connectionCallBack(const Gap::ConnectionCallbackParams_t *params)
     {
+        _connectedAt = Diagnostics::now();
         changeState(Handshake::CONNECTED);
     }
 
@@ -121,30 +275,27 @@ private:
             return;
         }
 
-        // Check step and change to next
-        if (_step > _HANDSHAKE_PAIRING_START && _step < _HANDSHAKE_PAIRING_END)
+        // Wait for the whole frame
+        if (!_certificateService->onDataWritten(params))
         {
-            _pendingState = (HandshakeStep)(_step + 1);
+            return;
         }
-    }
 
-    static void onSubscribed(const GattAttribute::Handle_t handle)
-    {
-        if (handle != Handshake::Instance()->_certificateService->sfidaCommandsHandle())
+        // Check step and change to next, later exchange traffic is not ours
+        if (_step > _HANDSHAKE_PAIRING_START && _step < RESP_00_00_00_00)
         {
-            return;
+            _pendingState = (HandshakeStep)(_step + 1);
+            rescheduleUpdate();
         }
-
-        Handshake::Instance()->changeState(SUBSCRIBED_SFIDA_COMMANDS);
     }
 
     static void securitySetupCompletedCallback(Gap::Handle_t handle, SecurityManager::SecurityCompletionStatus_t status)
     {
         if (status == SecurityManager::SEC_STATUS_SUCCESS) {
-            printf("Security success\r\n");
+            PGP_LOG("Security success\r\n");
             Handshake::Instance()->changeState(Handshake::BOND_DONE);
         } else {
-            printf("Security failed\r\n");
+            PGP_LOG("Security failed\r\n");
         }
     }
 
@@ -157,6 +308,7 @@ private:
         }
 
         _pendingState = step;
+        rescheduleUpdate();
         return true;
     }
 
@@ -180,22 +332,34 @@ private:
 
     bool onSfidaSubscribed()
     {
+        PROFILE_SCOPE("Handshake::onSfidaSubscribed");
+
         uint8_t command[4] = {0, 0, 0, 0};
-        uint8_t data[] = {
-            // 4-115 "random data"
-            0x32, 0x0a, 0x50, 0x23, 0x68, 0x09, 0xbe, 0x31, 0xfe, 0xc5, 0xeb, 0x67, 0xf4, 0xb5, 0x07, 0x11, 0x82, 0xe1, 0x34, 0x9b, 0xeb, 0x13, 0x69, 0xc4, 0xbd, 0x63, 0x2e, 0x37, 0x8a, 0xd5, 0x94, 0x53, 0x59, 0x19, 0x03, 0x59, 0x35, 0x0f, 0xa7, 0xb4, 0x86, 0xc5, 0xec, 0xcf, 0x6b, 0xb8, 0xbf, 0x30, 0x59, 0x5b, 0x31, 0x13, 0xb7, 0x24, 0x19, 0x4a, 0x85, 0x31, 0x34, 0xe7, 0xb0, 0xc6, 0x63, 0x7d, 0x5d, 0xab, 0x5c, 0xef, 0xcc, 0x4c, 0xbd, 0xb1, 0x78, 0x1f, 0x91, 0x7b, 0x54, 0xf8, 0x4f, 0xed, 0x1b, 0x87, 0x70, 0x37, 0x24, 0x4f, 0x5c, 0x61, 0x08, 0xde, 0x77, 0x0c, 0xe3, 0x5c, 0xa5, 0x9c, 0x93, 0x7d, 0xd1, 0xd8, 0xf8, 0x8f, 0x08, 0xa5, 0xb4, 0x20, 0x0f, 0x54, 0xcf, 0x29, 0x54, 0x4a,
 
-            // MAC in reverse order (will be filled in later)
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        // 4-115 "random data", a fresh nonce every handshake (retried on the next update if none is ready)
+        if (!_noncePool->draw(_nonce))
+        {
+            return false;
+        }
 
-            // 256 "device data"
-            0x8c, 0x10, 0x78, 0x8b, 0xfd, 0xcc, 0xb8, 0x94, 0x91, 0xec, 0x06, 0x85, 0xac, 0x8f, 0xee, 0x50, 0xfd, 0xcf, 0xf3, 0x14, 0x63, 0x58, 0xb2, 0x9e, 0x91, 0xed, 0x7e, 0x17, 0xf9, 0x61, 0xdb, 0x26, 0x47, 0x5f, 0xdb, 0x11, 0xea, 0xf8, 0xcc, 0xf0, 0xe3, 0x2b, 0x45, 0x82, 0x8c, 0x29, 0xf6, 0xac, 0xc2, 0x7d, 0x3a, 0x50, 0x6c, 0x69, 0xc6, 0xb1, 0x6a, 0x72, 0x99, 0xc6, 0x8d, 0x5f, 0x68, 0x04, 0x8d, 0xb9, 0x73, 0x5b, 0xc3, 0x83, 0x95, 0x42, 0x76, 0x31, 0x7b, 0x13, 0x38, 0xc9, 0x09, 0x65, 0x3d, 0x5a, 0x86, 0xa3, 0x34, 0x35, 0xf0, 0x51, 0xf6, 0x97, 0xac, 0x11, 0xf5, 0x04, 0xcb, 0x43, 0x50, 0x34, 0x1e, 0x91, 0x4a, 0x70, 0xc6, 0xef, 0xa9, 0x8d, 0xa9, 0x08, 0x46, 0xc5, 0x39, 0x1b, 0xad, 0xad, 0x82, 0xff, 0x5d, 0x10, 0xbd, 0x4c, 0x2f, 0x9d, 0xfe, 0x5c, 0x04, 0x56, 0x3e, 0x88, 0x3a, 0xf4, 0x30, 0xac, 0xf5, 0x58, 0xf8, 0x29, 0x2a, 0x48, 0x74, 0x14, 0x1b, 0xd8, 0xad, 0x64, 0x75, 0x8c, 0x26, 0x26, 0xc5, 0x9c, 0x7c, 0x49, 0x33, 0x4f, 0x15, 0xa2, 0x1b, 0x89, 0x90, 0x03, 0x7f, 0xc2, 0x5f, 0xe5, 0x97, 0xc9, 0x55, 0x2d, 0x25, 0xef, 0x4b, 0x67, 0x85, 0x99, 0x9d, 0xc1, 0xfb, 0x27, 0x20, 0xdb, 0x97, 0x7d, 0x1c, 0xfe, 0x58, 0x5a, 0x6a, 0xd3, 0x9d, 0x2e, 0x1f, 0x18, 0x68, 0xd8, 0x6e, 0xa5, 0xe0, 0x0e, 0x47, 0x1f, 0xe5, 0x29, 0x94, 0xad, 0x97, 0x35, 0xb6, 0xac, 0xa4, 0x17, 0x17, 0x56, 0x04, 0xa8, 0x74, 0x78, 0x61, 0x42, 0x15, 0xb9, 0x07, 0x4b, 0x76, 0x3a, 0x16, 0x0b, 0x11, 0x84, 0xd9, 0x74, 0xfc, 0x4b, 0xc9, 0x49, 0x95, 0x84, 0xca, 0x3e, 0x46, 0xc6, 0xda, 0xee, 0x8b, 0xbe, 0xa1, 0x3a, 0xcd, 0xd7, 0xc0, 0x7a, 0x42, 0x58, 0x27, 0x4a, 0xd6, 0x0a
+        // Fill in MAC
+        getMAC(_mac);
+
+        // Served straight from these buffers as the central reads sfidaToCentral,
+        // followed by 256 "device data"
+        MessageSegment segments[] = {
+            { _nonce, sizeof(_nonce) },
+            { _mac, sizeof(_mac) },
+            { SFIDA_DEVICE_DATA, sizeof(SFIDA_DEVICE_DATA) }
         };
 
-        // Fill in MAC
-        getMAC((uint8_t*)((intptr_t)data + 112));
+        if (!_certificateService->send(command, segments, sizeof(segments) / sizeof(MessageSegment)))
+        {
+            return false;
+        }
+
+        _certificateService->expectFrame(PAIRING_RESPONSE_LEN);
 
-        _certificateService->send(command, data, sizeof(data));
         _pendingState = SENT_00_00_00_00; // _step will be overwritten after returning
 
         return true;
@@ -203,11 +367,11 @@ private:
 
     bool onPairingResponse()
     {
-        uint16_t bytesRead;
-        uint8_t* buffer = _certificateService->read(&bytesRead);
+        FrameView frame = _certificateService->frame();
+        const uint8_t* buffer = frame.data;
 
         // Answer should be 20 bytes long
-        if (bytesRead != 20)
+        if (frame.len != PAIRING_RESPONSE_LEN)
         {
             return false;
         }
@@ -221,7 +385,7 @@ private:
         // 16 bytes remaning (IV? Key?)
         // Answer is 01-00-00-00 + 48 bytes
 
-        printf("Read %d bytes\n", bytesRead);
+        PGP_LOG("Read %d bytes (%d copied)\n", frame.len, frame.copied);
 
         return true;
     }
@@ -234,18 +398,23 @@ private:
     }
 
 private:
-    Handshake(BLEDevice &ble, CertificateService* certificateService) :
+    Handshake(BLEDevice &ble, EventQueue &eventQueue, CertificateService* certificateService, NoncePool* noncePool) :
         _ble(ble),
+        _eventQueue(eventQueue),
         _step(NONE),
-        _pendingState(NONE)
+        _pendingState(NONE),
+        _stepChangedAt(0),
+        _connectedAt(0),
+        _updateEvent(0),
+        _retries(0)
     {
         _certificateService = certificateService;
+        _noncePool = noncePool;
 
         // Register callbacks
         _ble.gap().onConnection(this, &Handshake::connectionCallBack);
         _ble.gap().onDisconnection(this, &Handshake::disconnectionCallback);
         _ble.gattServer().onDataWritten(this, &Handshake::onDataWritten);
-        _ble.gattServer().onUpdatesEnabled(&Handshake::onSubscribed);
         _ble.securityManager().onSecuritySetupCompleted(&Handshake::securitySetupCompletedCallback);
     }
 
@@ -253,10 +422,20 @@ private:
     static Handshake* _instance;
 
     BLEDevice& _ble;
+    EventQueue& _eventQueue;
     CertificateService* _certificateService;
+    NoncePool* _noncePool;
 
     HandshakeStep _step;
     HandshakeStep _pendingState;
+    uint32_t _stepChangedAt;
+    uint32_t _connectedAt;
+    Callback<void(uint32_t)> _completedCallback;
+    int _updateEvent;
+    uint8_t _retries;
+
+    uint8_t _nonce[NONCE_LEN];
+    uint8_t _mac[6];
 };
 
 #endif /* #ifndef __HANDSHAKE_H__ */
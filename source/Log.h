@@ -0,0 +1,34 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+
+
+/**
+ * Console logging. Disable with the "log" app option to strip every printf
+ * from the handshake and services, e.g. when driving them in a tight loop.
+ */
+#if !defined(MBED_CONF_APP_LOG) || MBED_CONF_APP_LOG
+#define PGP_LOG(...)    printf(__VA_ARGS__)
+#else
+// Never printed, but the arguments stay used and type-checked
+#define PGP_LOG(...)    do { if (0) printf(__VA_ARGS__); } while (0)
+#endif
+
+#endif /* #ifndef __LOG_H__ */
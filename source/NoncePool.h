@@ -0,0 +1,237 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NONCE_POOL_H__
+#define __NONCE_POOL_H__
+
+#include <events/mbed_events.h>
+#include <mbed.h>
+#include "mbedtls/ctr_drbg.h"
+#include "Diagnostics.h"
+
+#if DEVICE_TRNG && !MBED_CONF_APP_NONCE_POOL_SEED
+#include "hal/trng_api.h"
+#endif
+
+
+#define NONCE_LEN                   112
+#define NONCE_POOL_DEPTH            2
+#define ENTROPY_POOL_SIZE           64
+#define ENTROPY_POLL_INTERVAL_MS    20
+
+
+/**
+ * Raw entropy, collected a few bytes at a time without ever waiting.
+ *
+ * A non-zero "nonce-pool-seed" app option selects a deterministic xorshift
+ * stream so runs can be reproduced. Otherwise the target backend drains
+ * whatever the TRNG has ready, and builds without a TRNG read /dev/urandom.
+ * With none of these available construction fails with an error instead
+ * of leaving the pool forever unseeded.
+ */
+class EntropyPool
+{
+public:
+    EntropyPool() :
+        _available(0)
+    {
+#if MBED_CONF_APP_NONCE_POOL_SEED
+        _state = MBED_CONF_APP_NONCE_POOL_SEED | 1;
+#elif DEVICE_TRNG
+        trng_init(&_trng);
+#else
+        _urandom = fopen("/dev/urandom", "rb");
+        if (_urandom == NULL)
+        {
+            error("NoncePool: no entropy source, this target has no TRNG (see the nonce-pool-seed option)\r\n");
+        }
+#endif
+    }
+
+    size_t available() const
+    {
+        return _available;
+    }
+
+    bool full() const
+    {
+        return _available == sizeof(_pool);
+    }
+
+    /** Pull whatever the source can give right now */
+    void collect()
+    {
+        size_t wanted = sizeof(_pool) - _available;
+        if (wanted == 0)
+        {
+            return;
+        }
+
+        size_t got = 0;
+#if MBED_CONF_APP_NONCE_POOL_SEED
+        for (; got < wanted; got++)
+        {
+            _state ^= _state << 13;
+            _state ^= _state >> 17;
+            _state ^= _state << 5;
+            _pool[_available + got] = (uint8_t)_state;
+        }
+#elif DEVICE_TRNG
+        if (trng_get_bytes(&_trng, &_pool[_available], wanted, &got) != 0)
+        {
+            got = 0;
+        }
+#else
+        if (_urandom != NULL)
+        {
+            got = fread(&_pool[_available], 1, wanted, _urandom);
+        }
+#endif
+
+        _available += got;
+    }
+
+    /** mbedtls entropy callback, only succeeds with enough bytes pooled */
+    static int take(void* context, unsigned char* output, size_t len)
+    {
+        EntropyPool* self = (EntropyPool*)context;
+        if (len > self->_available)
+        {
+            return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+        }
+
+        self->_available -= len;
+        memcpy(output, &self->_pool[self->_available], len);
+        memset(&self->_pool[self->_available], 0, len);
+
+        return 0;
+    }
+
+private:
+    uint8_t _pool[ENTROPY_POOL_SIZE];
+    size_t _available;
+
+#if MBED_CONF_APP_NONCE_POOL_SEED
+    uint32_t _state;
+#elif DEVICE_TRNG
+    trng_t _trng;
+#else
+    FILE* _urandom;
+#endif
+};
+
+
+/**
+ * Handshake nonces, generated ahead of time.
+ *
+ * A CTR_DRBG seeded from the EntropyPool keeps NONCE_POOL_DEPTH nonces ready.
+ * draw() only copies one out and schedules a refill on the event queue, so
+ * the handshake never waits on the TRNG. Entropy is polled in the background
+ * only while the DRBG still needs (re)seeding or nonces are missing.
+ */
+class NoncePool
+{
+    friend class Benchmark;
+
+public:
+    NoncePool(EventQueue &eventQueue) :
+        _eventQueue(eventQueue),
+        _seeded(false),
+        _ready(0),
+        _next(0),
+        _refillPending(false)
+    {
+        mbedtls_ctr_drbg_init(&_drbg);
+        scheduleRefill(0);
+    }
+
+    ~NoncePool()
+    {
+        mbedtls_ctr_drbg_free(&_drbg);
+    }
+
+    /** Copy a ready NONCE_LEN bytes nonce out, false if none is ready yet */
+    bool draw(uint8_t* nonce)
+    {
+        if (_ready == 0)
+        {
+            scheduleRefill(0);
+            return false;
+        }
+
+        uint8_t slot = (_next + NONCE_POOL_DEPTH - _ready) % NONCE_POOL_DEPTH;
+        memcpy(nonce, _nonces[slot], NONCE_LEN);
+        memset(_nonces[slot], 0, NONCE_LEN);
+        _ready--;
+
+        scheduleRefill(0);
+        return true;
+    }
+
+private:
+    void scheduleRefill(int delayMs)
+    {
+        if (_refillPending)
+        {
+            return;
+        }
+
+        _refillPending = _eventQueue.call_in(delayMs, this, &NoncePool::refill) != 0;
+    }
+
+    void refill()
+    {
+        _refillPending = false;
+        Diagnostics::wakeup(WAKEUP_ENTROPY);
+        _entropy.collect();
+
+        if (!_seeded)
+        {
+            _seeded = mbedtls_ctr_drbg_seed(&_drbg, &EntropyPool::take, &_entropy, NULL, 0) == 0;
+        }
+
+        while (_seeded && _ready < NONCE_POOL_DEPTH)
+        {
+            // Fails only when a reseed is due and the pool is still short
+            if (mbedtls_ctr_drbg_random(&_drbg, _nonces[_next], NONCE_LEN) != 0)
+            {
+                break;
+            }
+
+            _next = (_next + 1) % NONCE_POOL_DEPTH;
+            _ready++;
+        }
+
+        // Keep topping the entropy up for the next reseed
+        if (!_seeded || _ready < NONCE_POOL_DEPTH || !_entropy.full())
+        {
+            scheduleRefill(ENTROPY_POLL_INTERVAL_MS);
+        }
+    }
+
+private:
+    EventQueue& _eventQueue;
+    EntropyPool _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+
+    bool _seeded;
+    uint8_t _nonces[NONCE_POOL_DEPTH][NONCE_LEN];
+    uint8_t _ready;
+    uint8_t _next;
+    bool _refillPending;
+};
+
+#endif /* #ifndef __NONCE_POOL_H__ */
@@ -0,0 +1,246 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <mbed.h>
+#include <stdio.h>
+#include <time.h>
+
+
+#define PROFILER_MAX_SITES      32
+#define PROFILER_MAX_DEPTH      8
+#define PROFILER_NO_PARENT      0xFF
+#define PROFILER_FOLDED_BEGIN   "PROFILE FOLDED BEGIN"
+#define PROFILER_FOLDED_END     "PROFILE FOLDED END"
+
+
+/**
+ * Scoped profiling probes.
+ *
+ * PROFILE_SCOPE("name") times the rest of the enclosing block. Sites are
+ * keyed by name and parent, so each distinct call path gets its own entry
+ * in a fixed table (count, min, max, total). Times are DWT cycles on
+ * Cortex-M3 and up, and nanoseconds from the monotonic clock elsewhere.
+ * dumpTable() prints the table, dumpFolded() a folded-stack profile of
+ * self time and nothing else, ready for flamegraph.pl. dump() prints
+ * both, the folded lines alone between PROFILER_FOLDED_BEGIN and
+ * PROFILER_FOLDED_END so they can be cut out of the console log:
+ *   sed -n '/^PROFILE FOLDED BEGIN$/,/^PROFILE FOLDED END$/{//!p}' log | flamegraph.pl
+ * Meant for the event queue thread only.
+ * With the "profiling" app option disabled, PROFILE_SCOPE expands to nothing.
+ */
+#if MBED_CONF_APP_PROFILING
+
+#define PROFILE_CONCAT_(a, b)   a ## b
+#define PROFILE_CONCAT(a, b)    PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name)     ProfileScope PROFILE_CONCAT(_profileScope, __LINE__)(name)
+
+class Profiler
+{
+public:
+    struct Site
+    {
+        const char* name;
+        uint8_t  parent;
+        uint32_t count;
+        uint32_t min;
+        uint32_t max;
+        uint64_t total;
+    };
+
+    static uint32_t now()
+    {
+#if defined(__CORTEX_M) && (__CORTEX_M >= 3)
+        if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk))
+        {
+            CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+            DWT->CYCCNT = 0;
+            DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        }
+
+        return DWT->CYCCNT;
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint32_t)((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+    }
+
+    /** Find or add the site for name under the scope currently open */
+    static uint8_t enter(const char* name)
+    {
+        // Too deep: not recorded, but keep nesting balanced
+        if (_depth >= PROFILER_MAX_DEPTH)
+        {
+            _depth++;
+            return PROFILER_NO_PARENT;
+        }
+
+        uint8_t parent = _depth ? _stack[_depth - 1] : PROFILER_NO_PARENT;
+
+        uint8_t index = PROFILER_NO_PARENT;
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            if (_sites[i].name == name && _sites[i].parent == parent)
+            {
+                index = i;
+                break;
+            }
+        }
+
+        if (index == PROFILER_NO_PARENT && _count < PROFILER_MAX_SITES)
+        {
+            index = _count++;
+            _sites[index].name = name;
+            _sites[index].parent = parent;
+            _sites[index].count = 0;
+            _sites[index].min = 0xFFFFFFFF;
+            _sites[index].max = 0;
+            _sites[index].total = 0;
+        }
+
+        // Table full: not recorded, children attach to the closest recorded scope
+        _stack[_depth++] = index != PROFILER_NO_PARENT ? index : parent;
+        return index;
+    }
+
+    static void leave(uint8_t index, uint32_t elapsed)
+    {
+        _depth--;
+
+        if (index == PROFILER_NO_PARENT)
+        {
+            return;
+        }
+
+        Site& site = _sites[index];
+        site.count++;
+        site.total += elapsed;
+        if (elapsed < site.min)
+        {
+            site.min = elapsed;
+        }
+        if (elapsed > site.max)
+        {
+            site.max = elapsed;
+        }
+    }
+
+    /** Zero every site; the table and the scopes still open are kept */
+    static void reset()
+    {
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            _sites[i].count = 0;
+            _sites[i].min = 0xFFFFFFFF;
+            _sites[i].max = 0;
+            _sites[i].total = 0;
+        }
+    }
+
+    static void dump()
+    {
+        dumpTable();
+        printf(PROFILER_FOLDED_BEGIN "\n");
+        dumpFolded();
+        printf(PROFILER_FOLDED_END "\n");
+    }
+
+    static void dumpTable()
+    {
+        printf("# site count min max total\n");
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            const Site& site = _sites[i];
+            printf("# %s %lu %lu %lu %llu\n", site.name, (unsigned long)site.count,
+                (unsigned long)(site.count ? site.min : 0), (unsigned long)site.max, (unsigned long long)site.total);
+        }
+    }
+
+    /** Folded stacks, self time only */
+    static void dumpFolded()
+    {
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            uint64_t self = _sites[i].total;
+            for (uint8_t j = 0; j < _count; j++)
+            {
+                if (_sites[j].parent == i)
+                {
+                    self -= _sites[j].total < self ? _sites[j].total : self;
+                }
+            }
+
+            printPath(i);
+            printf(" %llu\n", (unsigned long long)self);
+        }
+    }
+
+private:
+    static void printPath(uint8_t index)
+    {
+        if (_sites[index].parent != PROFILER_NO_PARENT)
+        {
+            printPath(_sites[index].parent);
+            printf(";");
+        }
+
+        printf("%s", _sites[index].name);
+    }
+
+    static Site _sites[PROFILER_MAX_SITES];
+    static uint8_t _count;
+    static uint8_t _stack[PROFILER_MAX_DEPTH];
+    static uint8_t _depth;
+};
+
+class ProfileScope
+{
+public:
+    ProfileScope(const char* name) :
+        _index(Profiler::enter(name)),
+        _start(Profiler::now())
+    {
+    }
+
+    ~ProfileScope()
+    {
+        Profiler::leave(_index, Profiler::now() - _start);
+    }
+
+private:
+    uint8_t _index;
+    uint32_t _start;
+};
+
+#else
+
+#define PROFILE_SCOPE(name)
+
+class Profiler
+{
+public:
+    static void reset() {}
+    static void dump() {}
+    static void dumpTable() {}
+    static void dumpFolded() {}
+};
+
+#endif
+
+#endif /* #ifndef __PROFILER_H__ */
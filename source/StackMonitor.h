@@ -0,0 +1,286 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2013 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __STACK_MONITOR_H__
+#define __STACK_MONITOR_H__
+
+#include <mbed.h>
+#include "platform/mbed_stats.h"
+#include "Log.h"
+
+#if MBED_CONF_APP_STACK_MONITOR
+#include "rtx_os.h"
+
+#if defined(TARGET_NRF5x)
+// Start of the application's .data, everything below it is SoftDevice RAM and the vector table
+extern "C" uint32_t __data_start__;
+#endif
+
+// An ARMv7-M MPU (nRF52, most Cortex-M3/M4/M7) turns the guard into a hard fault
+#if defined(__MPU_PRESENT) && __MPU_PRESENT && defined(MPU_RASR_ENABLE_Msk)
+#define STACK_GUARD_MPU             1
+#else
+#define STACK_GUARD_MPU             0
+#endif
+#endif
+
+
+#define STACK_MONITOR_MAX_THREADS   4
+#define STACK_PAINT_PATTERN         0xA5C3E1F0
+#define STACK_GUARD_PATTERN         0xDEADC0DE
+#define STACK_GUARD_SIZE            256         // bytes, power of two; a single frame larger than this can skip it
+#define STACK_GUARD_MPU_REGION      4           // first of STACK_MONITOR_MAX_THREADS MPU regions used for guards
+#define STACK_PAINT_MARGIN          64          // left untouched below the live stack pointer
+
+// The most a watched stack loses below the part its thread can use: the
+// magic word, the MPU alignment and the guard. Threads created with a
+// watch in mind add it to their stack size (a multiple of 8, as RTX wants).
+#if MBED_CONF_APP_STACK_MONITOR && STACK_GUARD_MPU
+#define STACK_GUARD_OVERHEAD        (2 * STACK_GUARD_SIZE)
+#elif MBED_CONF_APP_STACK_MONITOR
+#define STACK_GUARD_OVERHEAD        (STACK_GUARD_SIZE + 8)
+#else
+#define STACK_GUARD_OVERHEAD        0
+#endif
+
+MBED_STATIC_ASSERT(STACK_GUARD_SIZE >= 32 && (STACK_GUARD_SIZE & (STACK_GUARD_SIZE - 1)) == 0, "MPU regions are a power of two, at least 32 bytes");
+
+
+/**
+ * Stack and RAM high-water instrumentation.
+ *
+ * Watched thread stacks are painted below their live stack pointer and
+ * scanned for the deepest overwritten word. A guard of STACK_GUARD_SIZE
+ * bytes sits just above the RTX stack magic word. With an ARMv7-M MPU it
+ * is a no-access region, so the first push or frame store into it faults
+ * before anything below the stack is touched; watched threads must then
+ * never exit, or the guard would outlive their stack. Without an MPU it is
+ * a red zone of guard words that check() polls: that only reports an
+ * overflow after the fact, and a frame larger than the guard can jump it.
+ * The event queue arena is painted before the queue takes it over and its
+ * peak use is scanned the same way; that part is also kept for the
+ * "diagnostics" option, as the queue occupancy it reports. With neither
+ * option enabled everything compiles to nothing.
+ */
+class StackMonitor
+{
+public:
+#if MBED_CONF_APP_STACK_MONITOR || MBED_CONF_APP_DIAGNOSTICS
+    /** Paint a buffer that is about to become an allocator arena */
+    static uint8_t* paintArena(uint8_t* arena, size_t size)
+    {
+        uint32_t* words = (uint32_t*)arena;
+        for (size_t i = 0; i < size / 4; i++)
+        {
+            words[i] = STACK_PAINT_PATTERN;
+        }
+
+        _arena = arena;
+        _arenaSize = size;
+        return arena;
+    }
+
+    /** Peak bytes the event queue ever carved out of its arena */
+    static uint32_t arenaPeak()
+    {
+        if (_arena == NULL)
+        {
+            return 0;
+        }
+
+        // equeue carves chunks from the front of its slab
+        const uint32_t* words = (const uint32_t*)_arena;
+        size_t used = _arenaSize / 4;
+        while (used > 0 && words[used - 1] == STACK_PAINT_PATTERN)
+        {
+            used--;
+        }
+
+        return used * 4;
+    }
+
+    static size_t arenaSize()
+    {
+        return _arenaSize;
+    }
+#else
+    static uint8_t* paintArena(uint8_t* arena, size_t size) { return arena; }
+    static uint32_t arenaPeak() { return 0; }
+    static size_t arenaSize() { return 0; }
+#endif
+
+#if MBED_CONF_APP_STACK_MONITOR
+    /** Start watching a thread; either the caller or one that is not running right now */
+    static void watch(osThreadId_t id, const char* name)
+    {
+        if (_count >= STACK_MONITOR_MAX_THREADS || id == NULL)
+        {
+            return;
+        }
+
+        osRtxThread_t* thread = (osRtxThread_t*)id;
+        uint32_t* bottom = (uint32_t*)thread->stack_mem;
+        uint32_t sp = id == osThreadGetId() ? __get_PSP() : thread->sp;
+
+        // Word 0 is the RTX stack magic, the guard follows (size aligned for the MPU)
+        uint32_t* guard = bottom + 1;
+#if STACK_GUARD_MPU
+        guard = (uint32_t*)(((uint32_t)guard + STACK_GUARD_SIZE - 1) & ~(STACK_GUARD_SIZE - 1u));
+#endif
+        uint32_t* guardEnd = guard + STACK_GUARD_SIZE / 4;
+        uint32_t* paintEnd = (uint32_t*)((sp - STACK_PAINT_MARGIN) & ~3u);
+        if (guardEnd > paintEnd)
+        {
+            PGP_LOG("Stack %s: %lu bytes, too small for a guard\r\n", name, (unsigned long)thread->stack_size);
+            return;
+        }
+
+        fill(guardEnd, paintEnd - guardEnd, STACK_PAINT_PATTERN);
+
+        Watched& watched = _threads[_count];
+        watched.name = name;
+        watched.bottom = bottom;
+        watched.guard = guard;
+        watched.size = thread->stack_size;
+
+#if STACK_GUARD_MPU
+        protect(_count, guard);
+#else
+        fill(guard, STACK_GUARD_SIZE / 4, STACK_GUARD_PATTERN);
+#endif
+        _count++;
+    }
+
+    /** Cheap enough to call on every event: only the red zones are read, and not at all with the MPU */
+    static void check()
+    {
+#if !STACK_GUARD_MPU
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            const uint32_t* guard = _threads[i].guard;
+            for (int w = 0; w < STACK_GUARD_SIZE / 4; w++)
+            {
+                if (guard[w] != STACK_GUARD_PATTERN)
+                {
+                    error("Stack guard hit in %s thread (%lu bytes)\r\n", _threads[i].name, (unsigned long)_threads[i].size);
+                }
+            }
+        }
+#endif
+    }
+
+    /** Deepest use of a watched stack in bytes, 0 if unknown */
+    static uint32_t stackPeak(uint8_t index)
+    {
+        if (index >= _count)
+        {
+            return 0;
+        }
+
+        const Watched& watched = _threads[index];
+        const uint32_t* first = watched.guard + STACK_GUARD_SIZE / 4;
+        const uint32_t* end = watched.bottom + watched.size / 4;
+        const uint32_t* p = first;
+        while (p < end && *p == STACK_PAINT_PATTERN)
+        {
+            p++;
+        }
+
+        return (uint32_t)((const uint8_t*)end - (const uint8_t*)p);
+    }
+
+    static void report()
+    {
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            PGP_LOG("Stack %s: %lu / %lu bytes\r\n", _threads[i].name,
+                (unsigned long)stackPeak(i), (unsigned long)_threads[i].size);
+        }
+
+        PGP_LOG("EventQueue arena: %lu / %lu bytes\r\n", (unsigned long)arenaPeak(), (unsigned long)arenaSize());
+
+#if defined(MBED_STACK_STATS_ENABLED)
+        // Every other RTOS thread, from the RTX watermark
+        mbed_stats_stack_t stats[8];
+        size_t threads = mbed_stats_stack_get_each(stats, sizeof(stats) / sizeof(stats[0]));
+        for (size_t i = 0; i < threads; i++)
+        {
+            PGP_LOG("Thread %lx: %lu / %lu bytes\r\n", (unsigned long)stats[i].thread_id,
+                (unsigned long)stats[i].max_size, (unsigned long)stats[i].reserved_size);
+        }
+#endif
+
+#if defined(TARGET_NRF5x)
+        // What the linker script sets aside below .data, not what the SoftDevice uses of it
+        PGP_LOG("SoftDevice RAM reservation: %lu bytes, attribute table %lu bytes\r\n",
+            (unsigned long)((uint32_t)&__data_start__ - 0x20000000), (unsigned long)NRF_SDH_BLE_GATTS_ATTR_TAB_SIZE);
+#endif
+    }
+
+private:
+    struct Watched
+    {
+        const char* name;
+        uint32_t* bottom;
+        uint32_t* guard;
+        uint32_t size;
+    };
+
+#if STACK_GUARD_MPU
+    /** No access at all, from any mode, to the guard of watched thread index */
+    static void protect(uint8_t index, uint32_t* guard)
+    {
+        uint32_t sizeField = 30 - __CLZ(STACK_GUARD_SIZE);  // log2(size) - 1
+
+        core_util_critical_section_enter();
+        MPU->RBAR = ((uint32_t)guard & MPU_RBAR_ADDR_Msk) | MPU_RBAR_VALID_Msk |
+            ((STACK_GUARD_MPU_REGION + index) << MPU_RBAR_REGION_Pos);
+        MPU->RASR = MPU_RASR_XN_Msk | (0u << MPU_RASR_AP_Pos) | MPU_RASR_S_Msk | MPU_RASR_C_Msk |
+            (sizeField << MPU_RASR_SIZE_Pos) | MPU_RASR_ENABLE_Msk;
+
+        // Everything else keeps the default memory map
+        MPU->CTRL = MPU_CTRL_ENABLE_Msk | MPU_CTRL_PRIVDEFENA_Msk;
+        __DSB();
+        __ISB();
+        core_util_critical_section_exit();
+    }
+#endif
+
+    static void fill(uint32_t* words, size_t count, uint32_t pattern)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            words[i] = pattern;
+        }
+    }
+
+    static Watched _threads[STACK_MONITOR_MAX_THREADS];
+    static uint8_t _count;
+#else
+    static void watch(osThreadId_t id, const char* name) {}
+    static void check() {}
+    static uint32_t stackPeak(uint8_t index) { return 0; }
+    static void report() {}
+#endif
+
+#if MBED_CONF_APP_STACK_MONITOR || MBED_CONF_APP_DIAGNOSTICS
+private:
+    static uint8_t* _arena;
+    static size_t _arenaSize;
+#endif
+};
+
+#endif /* #ifndef __STACK_MONITOR_H__ */
@@ -21,29 +21,95 @@
 #include "ControlService.h"
 #include "CertificateService.h"
 #include "BatteryService.h"
+#include "Benchmark.h"
+#include "DiagnosticsService.h"
+#include "Diagnostics.h"
 #include "Handshake.h"
+#include "NoncePool.h"
+#include "Profiler.h"
+#include "StackMonitor.h"
+#include "Log.h"
 
 
 DigitalOut alivenessLED(LED1, 0);
 
-// const static char     DEVICE_NAME[] = "Podemos GO Plus";
-const static char     DEVICE_NAME[] = "Pokemon GO Plus";
-const static uint8_t  VENDOR_ID[] = {0x62, 0x04, 0xC5, 0x21, 0x00};
+// Each written once, the payloads below are built from the same tokens
+// #define DEVICE_NAME_STRING    "Podemos GO Plus"
+#define DEVICE_NAME_STRING    "Pokemon GO Plus"
+#define VENDOR_ID_BYTES       0x62, 0x04, 0xC5, 0x21, 0x00
 
-static EventQueue eventQueue(/* event count */ 10 * EVENTS_EVENT_SIZE);
+const static char     DEVICE_NAME[] = DEVICE_NAME_STRING;
+const static uint8_t  VENDOR_ID[] = {VENDOR_ID_BYTES};
 
+/* Advertising PDU: only what the phone needs to recognize us (flags + vendor data) */
+const static uint8_t  ADVERTISING_PAYLOAD[] = {
+    0x02, GapAdvertisingData::FLAGS, GapAdvertisingData::LE_GENERAL_DISCOVERABLE | GapAdvertisingData::BREDR_NOT_SUPPORTED,
+    1 + sizeof(VENDOR_ID), 0x20, VENDOR_ID_BYTES
+};
+
+/* Scan response: the name, its NUL is not sent */
+MBED_PACKED(struct) ScanResponsePayload
+{
+    uint8_t len;
+    uint8_t type;
+    char    name[sizeof(DEVICE_NAME_STRING)];
+};
+
+const static ScanResponsePayload SCAN_RESPONSE_PAYLOAD = {
+    sizeof(DEVICE_NAME_STRING), GapAdvertisingData::COMPLETE_LOCAL_NAME, DEVICE_NAME_STRING
+};
+
+MBED_STATIC_ASSERT(sizeof(ADVERTISING_PAYLOAD) <= GAP_ADVERTISING_DATA_MAX_PAYLOAD, "Advertising payload exceeds 31 bytes");
+MBED_STATIC_ASSERT(sizeof(SCAN_RESPONSE_PAYLOAD) - 1 <= GAP_ADVERTISING_DATA_MAX_PAYLOAD, "Scan response payload exceeds 31 bytes");
+
+#define ALIVENESS_PULSE_MS    5
+
+static uint32_t eventQueueArena[/* event count */ 10 * EVENTS_EVENT_SIZE / sizeof(uint32_t)];
+static EventQueue eventQueue(sizeof(eventQueueArena), StackMonitor::paintArena((uint8_t*)eventQueueArena, sizeof(eventQueueArena)));
+
+#if MBED_CONF_APP_FIRMWARE_UPDATE
 FirmwareService* firmwareServire;
+#endif
 ControlService* controlService;
 CertificateService* certificateService;
+#if BATTERY_LEVEL_SOURCE
 BatteryService* batteryService;
+#endif
+DiagnosticsService* diagnosticsService;
+NoncePool* noncePool;
 
 // Static declarations
 Handshake* Handshake::_instance = NULL;
+#if MBED_CONF_APP_DIAGNOSTICS
+volatile Diagnostics::Counters Diagnostics::_counters;
+#endif
+#if MBED_CONF_APP_BENCHMARK
+Handshake* Benchmark::_handshake = NULL;
+CertificateService* Benchmark::_certificateService = NULL;
+uint8_t Benchmark::_payload[SFIDA_TO_CENTRAL_MAX_LEN - SFIDA_COMMAND_LEN];
+#endif
+#if MBED_CONF_APP_PROFILING
+Profiler::Site Profiler::_sites[PROFILER_MAX_SITES];
+uint8_t Profiler::_count = 0;
+uint8_t Profiler::_stack[PROFILER_MAX_DEPTH];
+uint8_t Profiler::_depth = 0;
+#endif
+#if MBED_CONF_APP_STACK_MONITOR
+StackMonitor::Watched StackMonitor::_threads[STACK_MONITOR_MAX_THREADS];
+uint8_t StackMonitor::_count = 0;
+#endif
+#if MBED_CONF_APP_STACK_MONITOR || MBED_CONF_APP_DIAGNOSTICS
+uint8_t* StackMonitor::_arena = NULL;        // constant initialized, set while eventQueue is constructed
+size_t StackMonitor::_arenaSize = 0;
+#endif
 
 
 void disconnectionCallback(const Gap::DisconnectionCallbackParams_t *params)
 {
-    printf("Disconnection reason: %x\n", params->reason);
+    PGP_LOG("Disconnection reason: %x\n", params->reason);
+    Diagnostics::disconnected();
+    Profiler::dump();
+    StackMonitor::report();
 
     if (params->reason == 0x3D)
     {
@@ -55,13 +121,32 @@ void disconnectionCallback(const Gap::DisconnectionCallbackParams_t *params)
 
 void connectionCallBack(const Gap::ConnectionCallbackParams_t *params )
 {
-    printf("Connected\n");
+    PGP_LOG("Connected\n");
+    Diagnostics::connected();
 }
 
-void blinkCallback(void)
+/**
+ * GattServer keeps a single updates-enabled callback, share it out
+ */
+void updatesEnabledCallback(GattAttribute::Handle_t handle)
 {
-    alivenessLED = !alivenessLED; /* Do blinky on LED1 to indicate system aliveness. */
-    Handshake::Instance()->update();
+    Handshake::onSubscribed(handle);
+#if MBED_CONF_APP_DIAGNOSTICS
+    diagnosticsService->onUpdatesEnabled(handle);
+#endif
+}
+
+void alivenessOffCallback(void)
+{
+    alivenessLED = 0;
+}
+
+void alivenessCallback(void)
+{
+    /* Short pulse on LED1 to indicate system aliveness, the LED stays off in between. */
+    Diagnostics::wakeup(WAKEUP_ALIVENESS);
+    alivenessLED = 1;
+    eventQueue.call_in(ALIVENESS_PULSE_MS, alivenessOffCallback);
 }
 
 /**
@@ -72,17 +157,44 @@ void onBleInitError(BLE &ble, ble_error_t error)
     /* Initialization error handling should go here */
 }
 
+/**
+ * Load a pre-encoded AD structure list (length, type, data...) as is
+ */
+static void loadPayload(GapAdvertisingData& data, const uint8_t* payload, size_t len)
+{
+    size_t i = 0;
+    while (i + 1 < len && payload[i] != 0 && i + 1 + payload[i] <= len)
+    {
+        data.addData((GapAdvertisingData::DataType_t)payload[i + 1], &payload[i + 2], payload[i] - 1);
+        i += 1 + payload[i];
+    }
+}
+
+/**
+ * Apply both pre-encoded payloads to the stack
+ */
+void setAdvertisingPayloads(Gap& gap)
+{
+    GapAdvertisingData advertisingData;
+    GapAdvertisingData scanResponse;
+    loadPayload(advertisingData, ADVERTISING_PAYLOAD, sizeof(ADVERTISING_PAYLOAD));
+    loadPayload(scanResponse, (const uint8_t*)&SCAN_RESPONSE_PAYLOAD, sizeof(SCAN_RESPONSE_PAYLOAD) - 1);
+
+    gap.setScanResponse(scanResponse);
+    gap.setAdvertisingPayload(advertisingData);
+}
+
 void printMacAddress()
 {
     /* Print out device MAC address to the console*/
     Gap::AddressType_t addr_type;
     Gap::Address_t address;
     BLE::Instance().gap().getAddress(&addr_type, address);
-    printf("DEVICE MAC ADDRESS: ");
+    PGP_LOG("DEVICE MAC ADDRESS: ");
     for (int i = 5; i >= 1; i--){
-        printf("%02x:", address[i]);
+        PGP_LOG("%02x:", address[i]);
     }
-    printf("%02x\r\n", address[0]);
+    PGP_LOG("%02x\r\n", address[0]);
 }
 
 /**
@@ -90,6 +202,8 @@ void printMacAddress()
  */
 void bleInitComplete(BLE::InitializationCompleteCallbackContext *params)
 {
+    PROFILE_SCOPE("bleInitComplete");
+
     BLE&        ble   = params->ble;
     ble_error_t error = params->error;
 
@@ -117,22 +231,29 @@ void bleInitComplete(BLE::InitializationCompleteCallbackContext *params)
     ble.gap().onConnection(connectionCallBack);
     ble.gap().onDisconnection(disconnectionCallback);
 
-    //firmwareServire = new FirmwareService(ble);
+#if MBED_CONF_APP_FIRMWARE_UPDATE
+    firmwareServire = new FirmwareService(ble, eventQueue);
+#endif
     controlService = new ControlService(ble);
     certificateService = new CertificateService(ble);
-    batteryService = new BatteryService(ble);
+#if BATTERY_LEVEL_SOURCE
+    batteryService = new BatteryService(ble, eventQueue);
+#endif
+#if MBED_CONF_APP_DIAGNOSTICS
+    diagnosticsService = new DiagnosticsService(ble, eventQueue);
+#endif
     
     // Initial setup
-    Handshake::Init(ble, certificateService);
+    noncePool = new NoncePool(eventQueue);
+    Handshake::Init(ble, eventQueue, certificateService, noncePool);
+    ble.gattServer().onUpdatesEnabled(updatesEnabledCallback);
+
+#if MBED_CONF_APP_BENCHMARK
+    Benchmark::Run(Handshake::Instance(), certificateService);
+#endif
 
     /* setup advertising */
-    GapAdvertisingData advertisingData;
-    advertisingData.addAppearance(GapAdvertisingData::UNKNOWN);
-    advertisingData.addFlags(GapAdvertisingData::LE_GENERAL_DISCOVERABLE | GapAdvertisingData::BREDR_NOT_SUPPORTED);
-    advertisingData.addData(GapAdvertisingData::COMPLETE_LOCAL_NAME, (uint8_t*)DEVICE_NAME, sizeof(DEVICE_NAME));
-    advertisingData.addData((GapAdvertisingData::DataType_t)0x20, VENDOR_ID, sizeof(VENDOR_ID));
-    
-    ble.gap().setAdvertisingPayload(advertisingData);
+    setAdvertisingPayloads(ble.gap());
     ble.gap().setAdvertisingType(GapAdvertisingParams::ADV_CONNECTABLE_UNDIRECTED);
     ble.gap().setAdvertisingInterval(1000); /* 1000ms. */
     ble.gap().startAdvertising();
@@ -140,14 +261,33 @@ void bleInitComplete(BLE::InitializationCompleteCallbackContext *params)
     printMacAddress();
 }
 
+void processBleEvents()
+{
+    Diagnostics::bleEventDispatched();
+    Diagnostics::wakeup(WAKEUP_BLE);
+    StackMonitor::check();
+    BLE::Instance().processEvents();
+}
+
 void scheduleBleEventsProcessing(BLE::OnEventsToProcessCallbackContext* context) {
-    BLE &ble = BLE::Instance();
-    eventQueue.call(Callback<void()>(&ble, &BLE::processEvents));
+    // Count before posting so the dispatch can never run ahead of it
+    Diagnostics::bleEventQueued();
+    if (!eventQueue.call(processBleEvents))
+    {
+        Diagnostics::bleEventDispatched();
+        Diagnostics::eventQueueFull();
+    }
 }
 
 int main()
 {
-    eventQueue.call_every(500, blinkCallback);
+    StackMonitor::watch(osThreadGetId(), "main");
+
+    // Everything else is event driven, an idle device only wakes up for this
+    if (MBED_CONF_APP_ALIVENESS_PULSE_INTERVAL > 0)
+    {
+        eventQueue.call_every(MBED_CONF_APP_ALIVENESS_PULSE_INTERVAL, alivenessCallback);
+    }
 
     BLE &ble = BLE::Instance();
     ble.onEventsToProcess(scheduleBleEventsProcessing);